@@ -0,0 +1,29 @@
+#!/bin/sh
+# Draws the same scenes with every renderer and prints the average frame
+# time and vertex shader throughput of each. Vsync is turned off for Mesa 
+# and NVIDIA, other drivers may need it off in their settings. Extra 
+# arguments go to every run, like ./bench.sh --upload persistent
+#
+# FRAMES sets the run length, PARTICLES the scenes, FORMATS and RENDERERS
+# what is compared on them.
+
+FRAMES=${FRAMES:-600}
+PARTICLES=${PARTICLES:-"10000 100000 1000000"}
+FORMATS=${FORMATS:-"float half"}
+RENDERERS=${RENDERERS:-"attributes pull points geometry"}
+
+export vblank_mode=0
+export __GL_SYNC_TO_VBLANK=0
+
+make -s particles || exit 1
+
+printf "%-10s %-8s %-11s %s\n" particles format renderer result
+for n in $PARTICLES; do
+	for format in $FORMATS; do
+		for renderer in $RENDERERS; do
+			result=$(./particles --seed 1 --frames "$FRAMES" --particles "$n" \
+				--positions "$format" --render "$renderer" "$@" | grep "ms/frame")
+			printf "%-10s %-8s %-11s %s\n" "$n" "$format" "$renderer" "${result##* frames, }"
+		done
+	done
+done
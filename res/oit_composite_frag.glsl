@@ -0,0 +1,22 @@
+#version 330 core
+
+// Resolves the targets of particles_oit_frag.glsl into the weighted average
+// color, blended over the screen by how much the particles cover it.
+
+uniform sampler2D accumTexture;
+uniform sampler2D weightTexture;
+
+out vec4 color;
+
+void main() {
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	vec4 accum = texelFetch(accumTexture, texel, 0);
+	float weight = texelFetch(weightTexture, texel, 0).r;
+
+	// Revealage of 1 is a pixel no particle touched
+	float revealage = accum.a;
+	if (revealage >= 1.0)
+		discard;
+
+	color = vec4(accum.rgb / max(weight, 1e-5), 1.0 - revealage);
+}
@@ -0,0 +1,25 @@
+#version 330 core
+
+// particles_frag.glsl for weighted blended OIT, see oit.c. Writes into the
+// accum and weight targets instead of the screen.
+
+in vec2 UV;
+in vec4 particlecolor;
+
+layout(location = 0) out vec4 accum;
+layout(location = 1) out vec4 weight;
+
+uniform sampler2D particle_texture;
+
+void main() {
+	vec4 color = texture(particle_texture, UV) * particlecolor;
+
+	// Equation 7 of the paper, nearer fragments weigh more. 1/w of the 
+	// fragment is the clip w, its distance along the view direction.
+	float z = 1.0 / gl_FragCoord.w;
+	float w = color.a * clamp(10.0 / (1e-5 + pow(z / 5.0, 2.0) + pow(z / 200.0, 6.0)), 1e-2, 3e3);
+
+	// The alpha is multiplied in as 1 - alpha, the red of weight adds up
+	accum = vec4(color.rgb * w, color.a);
+	weight = vec4(w);
+}
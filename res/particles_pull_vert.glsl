@@ -0,0 +1,62 @@
+#version 330 core
+
+// Same as particles_vert.glsl, but without any vertex attributes. The quad
+// corner comes from gl_VertexID and everything per particle is fetched by
+// gl_InstanceID from texture buffers over the instance buffers.
+
+// float positions take 3 R32F texels, half and unorm16 one RGBA16F or
+// RGBA16 texel. positionBase is where this frame's positions start.
+uniform samplerBuffer positions;
+uniform int positionTexels;
+uniform int positionBase;
+
+// First particle of the system being drawn, gl_InstanceID starts at 0
+uniform int instanceBase;
+
+// One RG32UI texel per particle: the bits of the size and the packed color
+uniform usamplerBuffer statics;
+
+out vec2 UV;
+out vec4 particlecolor;
+
+uniform vec3 cameraRight_worldspace;
+uniform vec3 cameraUp_worldspace;
+uniform mat4 VP; // View * Projection matrices, no model
+
+uniform vec3 positionOrigin;
+uniform vec3 positionExtent;
+
+void main() {
+	// Triangle strip order: (-0.5, -0.5), (0.5, -0.5), (-0.5, 0.5), (0.5, 0.5)
+	vec2 squareVerts = vec2(gl_VertexID & 1, gl_VertexID >> 1) - vec2(0.5, 0.5);
+
+	int particle = instanceBase + gl_InstanceID;
+	int first = positionBase + particle * positionTexels;
+	vec3 xyz;
+	if (positionTexels == 3) {
+		xyz = vec3(
+			texelFetch(positions, first).r,
+			texelFetch(positions, first + 1).r,
+			texelFetch(positions, first + 2).r
+		);
+	} else {
+		xyz = texelFetch(positions, first).xyz;
+	}
+
+	uvec2 bits = texelFetch(statics, particle).xy;
+	float particleSize = uintBitsToFloat(bits.x);
+	uvec4 rgba = (uvec4(bits.y) >> uvec4(0u, 8u, 16u, 24u)) & 0xFFu;
+
+	vec3 particleCenter_worldspace = positionOrigin + xyz * positionExtent;
+
+	// Defines the size of the particle
+	vec3 vertexPosition_worldspace =
+		particleCenter_worldspace
+		+ cameraRight_worldspace * squareVerts.x * particleSize
+		+ cameraUp_worldspace * squareVerts.y * particleSize;
+
+	gl_Position = VP * vec4(vertexPosition_worldspace, 1.0f);
+
+	UV = squareVerts + vec2(0.5, 0.5);
+	particlecolor = vec4(rgba) / 255.0;
+}
@@ -1,8 +1,10 @@
 #version 330 core
 
 layout(location = 0) in vec3 squareVerts;
-layout(location = 1) in vec4 xyzs; // x, y, z and size
+layout(location = 1) in vec3 xyz;
 layout(location = 2) in vec4 color;
+layout(location = 3) in float size;
+layout(location = 4) in vec3 velocity; // Only from the GPU backends
 
 out vec2 UV;
 out vec4 particlecolor;
@@ -11,9 +13,19 @@ uniform vec3 cameraRight_worldspace;
 uniform vec3 cameraUp_worldspace;
 uniform mat4 VP; // View * Projection matrices, no model
 
+// unorm16 positions come in as 0 to 1 across the box of all particles, the
+// other formats are already in world space with an origin of 0 and extent 1
+uniform vec3 positionOrigin;
+uniform vec3 positionExtent;
+
+// The GPU backends draw the latest step and move back along the velocity,
+// the CPU has already interpolated and sets this to 0
+uniform float velocityBlend;
+
 void main() {
-	float particleSize = xyzs.w;
-	vec3 particleCenter_worldspace = xyzs.xyz;
+	float particleSize = size;
+	vec3 particleCenter_worldspace = positionOrigin + xyz * positionExtent 
+		+ velocity * velocityBlend;
 	
 	// Defines the size of the particle 
 	vec3 vertexPosition_worldspace =
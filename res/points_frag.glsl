@@ -0,0 +1,15 @@
+#version 330 core
+
+// particles_frag.glsl for point sprites, the UV comes from gl_PointCoord. 
+// That starts at the top, the texture is loaded flipped.
+
+in vec4 pointColor;
+
+out vec4 color;
+
+uniform sampler2D particle_texture;
+
+void main() {
+	vec2 UV = vec2(gl_PointCoord.x, 1.0 - gl_PointCoord.y);
+	color = texture(particle_texture, UV) * pointColor;
+}
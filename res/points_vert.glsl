@@ -0,0 +1,29 @@
+#version 330 core
+
+// One vertex per particle, for GL_POINTS and the quad geometry shader. The
+// attributes are the same instance data as particles_vert.glsl, read per 
+// vertex instead of per instance.
+
+layout(location = 1) in vec3 xyz;
+layout(location = 2) in vec4 color;
+layout(location = 3) in float size;
+
+out vec4 pointColor;
+out float pointSize; // World space, for the geometry shader
+
+uniform mat4 VP; // View * Projection matrices, no model
+
+uniform vec3 positionOrigin;
+uniform vec3 positionExtent;
+
+// Pixels per world unit at a clip w of 1, half the viewport height times
+// the projection's y scale
+uniform float pointScale;
+
+void main() {
+	gl_Position = VP * vec4(positionOrigin + xyz * positionExtent, 1.0f);
+	gl_PointSize = size * pointScale / gl_Position.w;
+
+	pointColor = color;
+	pointSize = size;
+}
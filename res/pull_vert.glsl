@@ -0,0 +1,46 @@
+#version 430 core
+
+// Same as particles_vert.glsl, but the position and velocity are pulled 
+// from the compute backend's storage buffer by instance instead of coming
+// in as attributes.
+
+layout(location = 0) in vec3 squareVerts;
+layout(location = 2) in vec4 color;
+layout(location = 3) in float size;
+
+struct Particle {
+	vec4 position;
+	vec4 velocity;
+};
+
+layout(std430, binding = 0) readonly buffer Particles {
+	Particle particles[];
+};
+
+out vec2 UV;
+out vec4 particlecolor;
+
+uniform vec3 cameraRight_worldspace;
+uniform vec3 cameraUp_worldspace;
+uniform mat4 VP; // View * Projection matrices, no model
+
+// Moves back along the velocity from the latest step
+uniform float velocityBlend;
+
+void main() {
+	Particle particle = particles[gl_InstanceID];
+	float particleSize = size;
+	vec3 particleCenter_worldspace = particle.position.xyz 
+		+ particle.velocity.xyz * velocityBlend;
+
+	// Defines the size of the particle 
+	vec3 vertexPosition_worldspace =
+		particleCenter_worldspace
+		+ cameraRight_worldspace * squareVerts.x * particleSize
+		+ cameraUp_worldspace * squareVerts.y * particleSize;
+
+	gl_Position = VP * vec4(vertexPosition_worldspace, 1.0f);
+
+	UV = squareVerts.xy + vec2(0.5, 0.5);
+	particlecolor = color;
+}
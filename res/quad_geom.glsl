@@ -0,0 +1,33 @@
+#version 330 core
+
+// Expands each point from points_vert.glsl into the same camera facing quad
+// particles_vert.glsl builds. The corners are offset in world space, which 
+// is the center's clip position plus VP times the offset.
+
+layout(points) in;
+layout(triangle_strip, max_vertices = 4) out;
+
+in vec4 pointColor[];
+in float pointSize[];
+
+out vec2 UV;
+out vec4 particlecolor;
+
+uniform vec3 cameraRight_worldspace;
+uniform vec3 cameraUp_worldspace;
+uniform mat4 VP;
+
+void main() {
+	vec3 right = cameraRight_worldspace * pointSize[0];
+	vec3 up = cameraUp_worldspace * pointSize[0];
+
+	// Triangle strip order, like the quad in main.c
+	for (int i = 0; i < 4; ++i) {
+		vec2 corner = vec2(i & 1, i >> 1) - vec2(0.5, 0.5);
+		gl_Position = gl_in[0].gl_Position + VP * vec4(right * corner.x + up * corner.y, 0.0f);
+		UV = corner + vec2(0.5, 0.5);
+		particlecolor = pointColor[0];
+		EmitVertex();
+	}
+	EndPrimitive();
+}
@@ -0,0 +1,36 @@
+#version 430 core
+
+// One simulation step per particle, in place, the same as 
+// updateParticlesScalar. WORKGROUP_SIZE is defined when the program is made.
+
+layout(local_size_x = WORKGROUP_SIZE) in;
+
+struct Particle {
+	vec4 position; // w is unused, vec3 would be padded to 16 bytes anyway
+	vec4 velocity;
+};
+
+layout(std430, binding = 0) buffer Particles {
+	Particle particles[];
+};
+
+uniform uint count;
+uniform float accel; // Length of the velocity change
+uniform float dt; // How many times the velocity is added to the position
+
+void main() {
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= count)
+		return;
+
+	vec3 position = particles[i].position.xyz;
+	vec3 direction = -position;
+	float len = length(direction);
+
+	// A particle at the origin is not pulled anywhere
+	float k = len < 1.1920929e-7 ? 0.0 : accel / len;
+
+	vec3 velocity = particles[i].velocity.xyz + direction * k;
+	particles[i].velocity.xyz = velocity;
+	particles[i].position.xyz = position + velocity * dt;
+}
@@ -0,0 +1,24 @@
+#version 330 core
+
+// One simulation step per particle, the same as updateParticlesScalar. The
+// results are captured with transform feedback, nothing is rasterized.
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 velocity;
+
+out vec3 outPosition;
+out vec3 outVelocity;
+
+uniform float accel; // Length of the velocity change
+uniform float dt; // How many times the velocity is added to the position
+
+void main() {
+	vec3 direction = -position;
+	float len = length(direction);
+
+	// A particle at the origin is not pulled anywhere
+	float k = len < 1.1920929e-7 ? 0.0 : accel / len;
+
+	outVelocity = velocity + direction * k;
+	outPosition = position + outVelocity * dt;
+}
@@ -0,0 +1,160 @@
+/* The compute shader backend. res/step_comp.glsl updates every particle in
+ * place, and a barrier between dispatches makes each step see the last.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+#include "compute.h"
+#include "shader.h"
+
+#define FLOATS_PER_PARTICLE 8 // x y z - vx vy vz -
+
+bool createComputeSim(struct ComputeSim* sim, int capacity, int workgroup, uint32_t quad_buffer, 
+		const struct InstanceBuffers* instances, const char* fragment_path) {
+	/* Creates the storage buffer with room for capacity particles and the
+	 * programs, the step with workgroup invocations per group and the draw
+	 * with the fragment shader at fragment_path. Leaves its own vertex 
+	 * array bound. Returns false if the GL can not run it.
+	 */
+	int vertex_blocks = 0;
+	if (GLEW_VERSION_4_3)
+		glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &vertex_blocks);
+	if (vertex_blocks < 1) {
+		fprintf(stderr, "No storage buffers in vertex shaders\n");
+		return false;
+	}
+
+	char defines[64];
+	snprintf(defines, sizeof(defines), "#define WORKGROUP_SIZE %d\n", workgroup);
+	sim->program = createProgramCompute("res/step_comp.glsl", defines);
+	sim->draw_program = createProgramVF("res/pull_vert.glsl", fragment_path);
+
+	int step_linked = 0, draw_linked = 0;
+	if (sim->program != 0)
+		glGetProgramiv(sim->program, GL_LINK_STATUS, &step_linked);
+	glGetProgramiv(sim->draw_program, GL_LINK_STATUS, &draw_linked);
+	if (!step_linked || !draw_linked) {
+		glDeleteProgram(sim->program);
+		glDeleteProgram(sim->draw_program);
+		return false;
+	}
+
+	sim->workgroup = workgroup;
+	sim->capacity = capacity;
+	sim->count = 0;
+
+	glGenBuffers(1, &sim->buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sim->buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (size_t)capacity * FLOATS_PER_PARTICLE * sizeof(float),
+		NULL, GL_DYNAMIC_COPY);
+
+	glGenVertexArrays(1, &sim->vao);
+	glBindVertexArray(sim->vao);
+
+	glBindBuffer(GL_ARRAY_BUFFER, quad_buffer);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	glVertexAttribDivisor(0, 0);
+
+	setupInstanceStaticAttributes(instances);
+
+	return true;
+}
+
+void destroyComputeSim(struct ComputeSim* sim) {
+	glDeleteVertexArrays(1, &sim->vao);
+	glDeleteBuffers(1, &sim->buffer);
+	glDeleteProgram(sim->program);
+	glDeleteProgram(sim->draw_program);
+}
+
+void uploadComputeSim(struct ComputeSim* sim, const struct ParticleSystem* ps, int begin, int end) {
+	/* Copies the particles [begin, end) of ps to the GPU, and counts them
+	 * from then on.
+	 */
+	if (end > sim->capacity)
+		end = sim->capacity;
+	if (begin >= end)
+		return;
+
+	// The steps write through the storage buffer, which mapping does not
+	// wait for on its own
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sim->buffer);
+	float* out = glMapBufferRange(
+		GL_SHADER_STORAGE_BUFFER,
+		(size_t)begin * FLOATS_PER_PARTICLE * sizeof(float),
+		(size_t)(end - begin) * FLOATS_PER_PARTICLE * sizeof(float),
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT
+	);
+	if (out == NULL) {
+		fprintf(stderr, "Could not map the compute buffer\n");
+		return;
+	}
+
+	for (int i = begin; i < end; ++i, out += FLOATS_PER_PARTICLE) {
+		out[0] = ps->x[i];
+		out[1] = ps->y[i];
+		out[2] = ps->z[i];
+		out[3] = 0.0f;
+		out[4] = ps->vx[i];
+		out[5] = ps->vy[i];
+		out[6] = ps->vz[i];
+		out[7] = 0.0f;
+	}
+	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+
+	if (end > sim->count)
+		sim->count = end;
+}
+
+void stepComputeSim(struct ComputeSim* sim, int steps, float accel, float dt) {
+	if (steps == 0 || sim->count == 0)
+		return;
+
+	glUseProgram(sim->program);
+	glUniform1ui(glGetUniformLocation(sim->program, "count"), (uint32_t)sim->count);
+	glUniform1f(glGetUniformLocation(sim->program, "accel"), accel);
+	glUniform1f(glGetUniformLocation(sim->program, "dt"), dt);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sim->buffer);
+
+	int groups = (sim->count + sim->workgroup - 1) / sim->workgroup;
+	for (int i = 0; i < steps; ++i) {
+		glDispatchCompute(groups, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+}
+
+void drawComputeSim(struct ComputeSim* sim) {
+	/* Draws with draw_program, which has to be in use with its uniforms set.
+	 */
+	glBindVertexArray(sim->vao);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sim->buffer);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, sim->count);
+}
+
+float compareComputeSim(struct ComputeSim* sim, const struct ParticleSystem* ps) {
+	/* Reads the particles back and returns their positionError against ps.
+	 * Waits for the GPU, so this is for checking, not for every frame.
+	 */
+	int count = sim->count < ps->count ? sim->count : ps->count;
+	if (count == 0)
+		return 0.0f;
+
+	float* gpu = malloc((size_t)count * FLOATS_PER_PARTICLE * sizeof(float));
+	if (gpu == NULL)
+		return INFINITY;
+
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sim->buffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (size_t)count * FLOATS_PER_PARTICLE * sizeof(float), gpu);
+
+	float worst = positionError(ps, gpu, FLOATS_PER_PARTICLE, count);
+
+	free(gpu);
+	return worst;
+}
@@ -0,0 +1,33 @@
+#ifndef COMPUTE_H
+#define COMPUTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "particles.h"
+#include "instances.h"
+
+/* Runs the simulation in a compute shader on one storage buffer of position
+ * and velocity (vec4 each), which the draw pulls from by instance. Needs GL
+ * 4.3. Like the feedback backend it keeps the particles from uploadComputeSim.
+ */
+struct ComputeSim {
+	uint32_t program; // The step
+	uint32_t draw_program;
+	uint32_t buffer;
+	uint32_t vao; // Draws, the step needs no attributes
+	int workgroup;
+	int capacity;
+	int count;
+};
+
+bool createComputeSim(struct ComputeSim* sim, int capacity, int workgroup, uint32_t quad_buffer, 
+	const struct InstanceBuffers* instances, const char* fragment_path);
+void destroyComputeSim(struct ComputeSim* sim);
+
+void uploadComputeSim(struct ComputeSim* sim, const struct ParticleSystem* ps, int begin, int end);
+void stepComputeSim(struct ComputeSim* sim, int steps, float accel, float dt);
+void drawComputeSim(struct ComputeSim* sim);
+float compareComputeSim(struct ComputeSim* sim, const struct ParticleSystem* ps);
+
+#endif
@@ -0,0 +1,179 @@
+/* The transform feedback backend. A step draws GL_POINTS with the rasterizer
+ * off, res/step_vert.glsl reads one buffer and feedback writes the other.
+ * Drawing interpolates back from the last step, new - v * dt * (1 - alpha).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+#include "feedback.h"
+#include "shader.h"
+
+#define FLOATS_PER_PARTICLE 6 // x y z vx vy vz
+
+static void setupStep(uint32_t vao, uint32_t buffer) {
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 
+		FLOATS_PER_PARTICLE * sizeof(float), (void*)0);
+
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 
+		FLOATS_PER_PARTICLE * sizeof(float), (void*)(3 * sizeof(float)));
+}
+
+static void setupDraw(uint32_t vao, uint32_t buffer, uint32_t quad_buffer, const struct InstanceBuffers* instances) {
+	glBindVertexArray(vao);
+
+	glBindBuffer(GL_ARRAY_BUFFER, quad_buffer);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	glVertexAttribDivisor(0, 0);
+
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glEnableVertexAttribArray(INSTANCE_POSITION_ATTRIBUTE);
+	glVertexAttribDivisor(INSTANCE_POSITION_ATTRIBUTE, 1);
+	glVertexAttribPointer(INSTANCE_POSITION_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, 
+		FLOATS_PER_PARTICLE * sizeof(float), (void*)0);
+
+	glEnableVertexAttribArray(FEEDBACK_VELOCITY_ATTRIBUTE);
+	glVertexAttribDivisor(FEEDBACK_VELOCITY_ATTRIBUTE, 1);
+	glVertexAttribPointer(FEEDBACK_VELOCITY_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, 
+		FLOATS_PER_PARTICLE * sizeof(float), (void*)(3 * sizeof(float)));
+
+	setupInstanceStaticAttributes(instances);
+}
+
+bool createFeedbackSim(struct FeedbackSim* sim, int capacity, uint32_t quad_buffer, const struct InstanceBuffers* instances) {
+	/* Creates the buffers with room for capacity particles, and the vertex
+	 * arrays to step and draw them. Leaves its own vertex array bound.
+	 * Returns false if the step shader does not link.
+	 */
+	const char* varyings[] = {"outPosition", "outVelocity"};
+	sim->program = createProgramFeedback("res/step_vert.glsl", varyings, 2);
+
+	int linked;
+	glGetProgramiv(sim->program, GL_LINK_STATUS, &linked);
+	if (!linked)
+		return false;
+
+	sim->current = 0;
+	sim->capacity = capacity;
+	sim->count = 0;
+
+	glGenBuffers(2, sim->buffers);
+	glGenVertexArrays(2, sim->step_vaos);
+	glGenVertexArrays(2, sim->draw_vaos);
+	for (int i = 0; i < 2; ++i) {
+		glBindBuffer(GL_ARRAY_BUFFER, sim->buffers[i]);
+		glBufferData(GL_ARRAY_BUFFER, (size_t)capacity * FLOATS_PER_PARTICLE * sizeof(float), 
+			NULL, GL_DYNAMIC_COPY);
+
+		setupStep(sim->step_vaos[i], sim->buffers[i]);
+		setupDraw(sim->draw_vaos[i], sim->buffers[i], quad_buffer, instances);
+	}
+
+	return true;
+}
+
+void destroyFeedbackSim(struct FeedbackSim* sim) {
+	glDeleteVertexArrays(2, sim->step_vaos);
+	glDeleteVertexArrays(2, sim->draw_vaos);
+	glDeleteBuffers(2, sim->buffers);
+	glDeleteProgram(sim->program);
+}
+
+void uploadFeedbackSim(struct FeedbackSim* sim, const struct ParticleSystem* ps, int begin, int end) {
+	/* Copies the particles [begin, end) of ps to the GPU, and counts them
+	 * from then on. Their previous position is dropped, they start at the
+	 * current one.
+	 */
+	if (end > sim->capacity)
+		end = sim->capacity;
+	if (begin >= end)
+		return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, sim->buffers[sim->current]);
+	float* out = glMapBufferRange(
+		GL_ARRAY_BUFFER,
+		(size_t)begin * FLOATS_PER_PARTICLE * sizeof(float),
+		(size_t)(end - begin) * FLOATS_PER_PARTICLE * sizeof(float),
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT
+	);
+	if (out == NULL) {
+		fprintf(stderr, "Could not map the feedback buffer\n");
+		return;
+	}
+
+	for (int i = begin; i < end; ++i, out += FLOATS_PER_PARTICLE) {
+		out[0] = ps->x[i];
+		out[1] = ps->y[i];
+		out[2] = ps->z[i];
+		out[3] = ps->vx[i];
+		out[4] = ps->vy[i];
+		out[5] = ps->vz[i];
+	}
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+
+	if (end > sim->count)
+		sim->count = end;
+}
+
+void stepFeedbackSim(struct FeedbackSim* sim, int steps, float accel, float dt) {
+	if (steps == 0 || sim->count == 0)
+		return;
+
+	glUseProgram(sim->program);
+	glUniform1f(glGetUniformLocation(sim->program, "accel"), accel);
+	glUniform1f(glGetUniformLocation(sim->program, "dt"), dt);
+	glEnable(GL_RASTERIZER_DISCARD);
+
+	for (int i = 0; i < steps; ++i) {
+		int next = 1 - sim->current;
+		glBindVertexArray(sim->step_vaos[sim->current]);
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, sim->buffers[next]);
+
+		glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, sim->count);
+		glEndTransformFeedback();
+
+		sim->current = next;
+	}
+
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	glDisable(GL_RASTERIZER_DISCARD);
+}
+
+void drawFeedbackSim(struct FeedbackSim* sim) {
+	/* Draws the latest step with the program in use, which has to set the
+	 * velocityBlend uniform.
+	 */
+	glBindVertexArray(sim->draw_vaos[sim->current]);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, sim->count);
+}
+
+float compareFeedbackSim(struct FeedbackSim* sim, const struct ParticleSystem* ps) {
+	/* Reads the particles back and returns their positionError against ps.
+	 * Waits for the GPU, so this is for checking, not for every frame.
+	 */
+	int count = sim->count < ps->count ? sim->count : ps->count;
+	if (count == 0)
+		return 0.0f;
+
+	float* gpu = malloc((size_t)count * FLOATS_PER_PARTICLE * sizeof(float));
+	if (gpu == NULL)
+		return INFINITY;
+
+	glBindBuffer(GL_ARRAY_BUFFER, sim->buffers[sim->current]);
+	glGetBufferSubData(GL_ARRAY_BUFFER, 0, (size_t)count * FLOATS_PER_PARTICLE * sizeof(float), gpu);
+
+	float worst = positionError(ps, gpu, FLOATS_PER_PARTICLE, count);
+
+	free(gpu);
+	return worst;
+}
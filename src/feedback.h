@@ -0,0 +1,35 @@
+#ifndef FEEDBACK_H
+#define FEEDBACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "particles.h"
+#include "instances.h"
+
+// Vertex attribute location of the velocity in res/particles_vert.glsl
+#define FEEDBACK_VELOCITY_ATTRIBUTE 4
+
+/* Runs the simulation on the GPU with transform feedback, ping-ponging
+ * between two buffers of position and velocity that are drawn from directly.
+ * It keeps the particles from uploadFeedbackSim, nothing spawns or dies.
+ */
+struct FeedbackSim {
+	uint32_t program;
+	uint32_t buffers[2];
+	uint32_t step_vaos[2]; // Read buffers[i]
+	uint32_t draw_vaos[2]; // Draw buffers[i]
+	int current; // Index of the buffer with the latest step
+	int capacity;
+	int count;
+};
+
+bool createFeedbackSim(struct FeedbackSim* sim, int capacity, uint32_t quad_buffer, const struct InstanceBuffers* instances);
+void destroyFeedbackSim(struct FeedbackSim* sim);
+
+void uploadFeedbackSim(struct FeedbackSim* sim, const struct ParticleSystem* ps, int begin, int end);
+void stepFeedbackSim(struct FeedbackSim* sim, int steps, float accel, float dt);
+void drawFeedbackSim(struct FeedbackSim* sim);
+float compareFeedbackSim(struct FeedbackSim* sim, const struct ParticleSystem* ps);
+
+#endif
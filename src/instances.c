@@ -0,0 +1,574 @@
+/* Streams the packed particles to the GPU. The jobs write straight into
+ * mapped buffer memory, see UploadMode for how it gets mapped.
+ * More on this: https://www.khronos.org/opengl/wiki/Buffer_Object_Streaming
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#include <SDL2/SDL.h>
+
+#include "instances.h"
+
+static const GLbitfield map_flags = 
+	GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+
+static const GLbitfield persistent_flags = 
+	GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+// GL type of each PositionFormat
+static const GLenum position_types[] = {GL_FLOAT, GL_HALF_FLOAT, GL_UNSIGNED_SHORT};
+
+// Texture buffer format of each PositionFormat. Core 3.3 has no three 
+// channel float format, so float positions are read one texel per axis.
+static const GLenum position_texture_formats[] = {GL_R32F, GL_RGBA16F, GL_RGBA16};
+static const int position_texels[] = {3, 1, 1};
+
+static size_t positionSize(const struct InstanceBuffers* instances, int count) {
+	return (size_t)count * positionStride(instances->format);
+}
+
+static size_t regionSize(const struct InstanceBuffers* instances, int capacity) {
+	/* Room for one frame of capacity particles.
+	 */
+	size_t size = positionSize(instances, capacity);
+	if (instances->stream_static)
+		size += (size_t)capacity * sizeof(struct StaticInstance);
+	return size;
+}
+
+static size_t writtenSize(const struct InstanceBuffers* instances, int count) {
+	/* How much of the region a frame of count particles writes. The 
+	 * streamed statics come after the room for all positions.
+	 */
+	if (!instances->stream_static)
+		return positionSize(instances, count);
+	return positionSize(instances, instances->capacity) + (size_t)count * sizeof(struct StaticInstance);
+}
+
+static void waitFence(struct InstanceBuffers* instances, int region) {
+	GLsync fence = instances->fences[region];
+	if (fence == NULL)
+		return;
+
+	uint64_t start = SDL_GetPerformanceCounter();
+	GLenum result;
+	do {
+		result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1 ms
+	} while (result == GL_TIMEOUT_EXPIRED);
+	instances->fence_wait_ms += (double)((SDL_GetPerformanceCounter() - start)*1000) 
+		/ SDL_GetPerformanceFrequency();
+
+	glDeleteSync(fence);
+	instances->fences[region] = NULL;
+}
+
+static void growStaticBuffer(uint32_t* buffer, size_t old_size, size_t new_size) {
+	/* Replaces buffer with a bigger one and copies what it held on the GPU,
+	 * so the slots that did not change need no upload.
+	 */
+	uint32_t grown;
+	glGenBuffers(1, &grown);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+	glBufferData(GL_COPY_WRITE_BUFFER, new_size, NULL, GL_DYNAMIC_DRAW);
+
+	if (*buffer != 0 && old_size > 0) {
+		glBindBuffer(GL_COPY_READ_BUFFER, *buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, old_size);
+	}
+	if (*buffer != 0)
+		glDeleteBuffers(1, buffer);
+	*buffer = grown;
+}
+
+static void pointPositions(struct InstanceBuffers* instances, int base) {
+	/* Points the position attribute at this frame's positions, starting at
+	 * particle base.
+	 */
+	glBindBuffer(GL_ARRAY_BUFFER, instances->position_buffer);
+	glVertexAttribPointer(
+		INSTANCE_POSITION_ATTRIBUTE,
+		3,
+		position_types[instances->format],
+		instances->format == POSITION_UNORM16,
+		positionStride(instances->format),
+		(void*)(instances->position_offset + positionSize(instances, base))
+	);
+}
+
+static void pointStatic(const struct InstanceBuffers* instances, int base) {
+	size_t offset = (size_t)base * sizeof(struct StaticInstance);
+
+	if (instances->stream_static) {
+		// The upload thread has no buffer to point at before the first frame
+		if (instances->position_buffer == 0)
+			return;
+		offset += instances->static_offset;
+		glBindBuffer(GL_ARRAY_BUFFER, instances->position_buffer);
+	} else {
+		if (instances->static_buffer == 0)
+			return;
+		glBindBuffer(GL_ARRAY_BUFFER, instances->static_buffer);
+	}
+	glVertexAttribPointer(
+		INSTANCE_SIZE_ATTRIBUTE,
+		1,
+		GL_FLOAT,
+		GL_FALSE,
+		sizeof(struct StaticInstance),
+		(void*)(offset + offsetof(struct StaticInstance, size))
+	);
+	glVertexAttribPointer(
+		INSTANCE_COLOR_ATTRIBUTE,
+		4,
+		GL_UNSIGNED_BYTE,
+		GL_TRUE,
+		sizeof(struct StaticInstance),
+		(void*)(offset + offsetof(struct StaticInstance, color))
+	);
+}
+
+static void setupAttributes(struct InstanceBuffers* instances) {
+	/* Points the instance attributes of the bound vertex array at the 
+	 * buffers. Every attribute advances by the divisor.
+	 */
+	glEnableVertexAttribArray(INSTANCE_POSITION_ATTRIBUTE);
+	glVertexAttribDivisor(INSTANCE_POSITION_ATTRIBUTE, instances->divisor);
+	pointPositions(instances, 0);
+
+	setupInstanceStaticAttributes(instances);
+}
+
+void setupInstanceStaticAttributes(const struct InstanceBuffers* instances) {
+	/* Points the size and color attributes of the bound vertex array at the
+	 * static buffer, for other ways to draw the same slots.
+	 */
+	glEnableVertexAttribArray(INSTANCE_SIZE_ATTRIBUTE);
+	glVertexAttribDivisor(INSTANCE_SIZE_ATTRIBUTE, instances->divisor);
+	glEnableVertexAttribArray(INSTANCE_COLOR_ATTRIBUTE);
+	glVertexAttribDivisor(INSTANCE_COLOR_ATTRIBUTE, instances->divisor);
+	pointStatic(instances, 0);
+}
+
+static void allocateBuffers(struct InstanceBuffers* instances, int capacity) {
+	int old_capacity = instances->capacity;
+	instances->capacity = capacity;
+
+	if (!instances->stream_static && instances->mode != UPLOAD_THREAD) {
+		growStaticBuffer(&instances->static_buffer, 
+			old_capacity * sizeof(struct StaticInstance), 
+			capacity * sizeof(struct StaticInstance));
+	}
+
+	if (instances->mode == UPLOAD_MAP) {
+		glBindBuffer(GL_ARRAY_BUFFER, instances->position_buffer);
+		glBufferData(GL_ARRAY_BUFFER, regionSize(instances, capacity), NULL, GL_STREAM_DRAW);
+		instances->static_offset = positionSize(instances, capacity);
+		setupAttributes(instances);
+		return;
+	}
+
+	// The upload thread grows its buffers when it maps them next, and the
+	// static buffers grow when their region is written next
+	if (instances->mode == UPLOAD_THREAD) {
+		if (!instances->stream_static) {
+			struct StaticInstance* copy = realloc(instances->static_copy, sizeof(struct StaticInstance) * capacity);
+			if (copy != NULL) {
+				instances->static_copy = copy;
+				instances->static_copy_capacity = capacity;
+			} else {
+				fprintf(stderr, "Could not grow the static instance copy\n");
+			}
+		}
+		setupAttributes(instances);
+		return;
+	}
+
+	// Immutable storage can not be resized, so growing makes a new buffer
+	for (int i = 0; i < INSTANCE_REGIONS; ++i)
+		waitFence(instances, i);
+	if (instances->ring != NULL) {
+		glDeleteBuffers(1, &instances->position_buffer);
+		glGenBuffers(1, &instances->position_buffer);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, instances->position_buffer);
+	size_t ring_size = INSTANCE_REGIONS * regionSize(instances, capacity);
+	glBufferStorage(GL_ARRAY_BUFFER, ring_size, NULL, persistent_flags);
+	instances->ring = glMapBufferRange(GL_ARRAY_BUFFER, 0, ring_size, persistent_flags);
+
+	if (instances->ring == NULL)
+		fprintf(stderr, "Could not map the instance ring\n");
+
+	instances->position_offset = 0;
+	instances->static_offset = positionSize(instances, capacity);
+	setupAttributes(instances);
+}
+
+void createInstanceBuffers(struct InstanceBuffers* instances, int capacity, enum UploadMode mode, enum PositionFormat format, bool stream_static) {
+	/* Creates the buffers with room for capacity particles. Falls back to 
+	 * UPLOAD_MAP if mode is UPLOAD_PERSISTENT and buffer storage is missing,
+	 * or if mode is UPLOAD_THREAD and the thread does not start. That needs
+	 * the window's context to be current.
+	 */
+	if (mode == UPLOAD_PERSISTENT && !(GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)) {
+		fprintf(stderr, "No buffer storage, uploading by mapping instead\n");
+		mode = UPLOAD_MAP;
+	}
+
+	instances->upload = NULL;
+	if (mode == UPLOAD_THREAD) {
+		instances->upload = createUploadThread(SDL_GL_GetCurrentWindow(), SDL_GL_GetCurrentContext());
+		if (instances->upload == NULL) {
+			fprintf(stderr, "No upload thread, uploading by mapping instead\n");
+			mode = UPLOAD_MAP;
+		}
+	}
+
+	instances->mode = mode;
+	instances->format = format;
+	instances->stream_static = stream_static;
+	instances->position_buffer = 0;
+	if (mode != UPLOAD_THREAD)
+		glGenBuffers(1, &instances->position_buffer);
+	instances->static_buffer = 0;
+	instances->capacity = 0;
+	instances->divisor = 1;
+	instances->positions = NULL;
+	instances->statics = NULL;
+	instances->count = 0;
+	instances->position_offset = 0;
+	instances->static_offset = 0;
+	instances->region = 0;
+	for (int i = 0; i < INSTANCE_REGIONS; ++i)
+		instances->fences[i] = NULL;
+	instances->ring = NULL;
+	instances->draw_region = 0;
+	for (int i = 0; i < INSTANCE_MAX_REGIONS; ++i) {
+		instances->region_counts[i] = 0;
+		instances->region_capacities[i] = 0;
+		instances->region_statics[i] = 0;
+		instances->region_static_capacities[i] = 0;
+		instances->region_dirty_begin[i] = 0;
+		instances->region_dirty_end[i] = 0;
+	}
+	instances->static_copy = NULL;
+	instances->static_copy_capacity = 0;
+	instances->fence_wait_ms = 0.0;
+	instances->position_texture = 0;
+	instances->static_texture = 0;
+	instances->max_texels = 0;
+
+	// The commands' base_instance needs 4.2 or ARB_base_instance
+	instances->multi_draw = GLEW_VERSION_4_3 
+		|| (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+	instances->indirect_buffer = 0;
+	instances->draw_commands = NULL;
+	instances->draw_capacity = 0;
+
+	allocateBuffers(instances, capacity);
+}
+
+void setInstanceDivisor(struct InstanceBuffers* instances, int divisor) {
+	/* Makes the attributes of the bound vertex array advance once every 
+	 * divisor instances. With 0 they advance per vertex, so the same buffers
+	 * can be drawn as GL_POINTS, one vertex per particle.
+	 */
+	instances->divisor = divisor;
+	setupAttributes(instances);
+}
+
+void destroyInstanceBuffers(struct InstanceBuffers* instances) {
+	for (int i = 0; i < INSTANCE_REGIONS; ++i)
+		if (instances->fences[i] != NULL)
+			glDeleteSync(instances->fences[i]);
+
+	// The upload thread owns its buffers, static_buffer is one of the
+	// region ones then
+	if (instances->mode == UPLOAD_THREAD) {
+		destroyUploadThread(instances->upload);
+		glDeleteBuffers(INSTANCE_MAX_REGIONS, instances->region_statics);
+		free(instances->static_copy);
+	} else {
+		glDeleteBuffers(1, &instances->position_buffer);
+		glDeleteBuffers(1, &instances->static_buffer);
+	}
+	glDeleteTextures(1, &instances->position_texture);
+	glDeleteTextures(1, &instances->static_texture);
+	glDeleteBuffers(1, &instances->indirect_buffer);
+	free(instances->draw_commands);
+}
+
+bool beginInstanceUpload(struct InstanceBuffers* instances, int count, int capacity) {
+	/* Maps room for count particles. The buffers grow first if the particles
+	 * grew past their capacity. Returns false if there is nothing to write
+	 * to, positions is NULL then.
+	 */
+	instances->fence_wait_ms = 0.0;
+	if (capacity > instances->capacity)
+		allocateBuffers(instances, capacity);
+
+	instances->count = count;
+	instances->positions = NULL;
+	instances->statics = NULL;
+	if (count == 0)
+		return false;
+
+	if (instances->mode == UPLOAD_PERSISTENT) {
+		if (instances->ring == NULL)
+			return false;
+
+		// Wait until the GPU is done with what was drawn from this region
+		instances->region = (instances->region + 1) % INSTANCE_REGIONS;
+		waitFence(instances, instances->region);
+
+		instances->position_offset = instances->region * regionSize(instances, instances->capacity);
+		instances->static_offset = instances->position_offset + positionSize(instances, instances->capacity);
+		instances->positions = instances->ring + instances->position_offset;
+	} else if (instances->mode == UPLOAD_THREAD) {
+		instances->positions = beginUploadBuffer(instances->upload, writtenSize(instances, count),
+			regionSize(instances, instances->capacity), &instances->region, &instances->fence_wait_ms);
+		if (instances->positions == NULL)
+			return false;
+		instances->region_capacities[instances->region] = instances->capacity;
+	} else {
+		glBindBuffer(GL_ARRAY_BUFFER, instances->position_buffer);
+		instances->positions = glMapBufferRange(GL_ARRAY_BUFFER, 0, writtenSize(instances, count), map_flags);
+		if (instances->positions == NULL) {
+			fprintf(stderr, "Could not map the instance buffers\n");
+			return false;
+		}
+	}
+
+	if (instances->stream_static) {
+		instances->statics = (struct StaticInstance*)
+			((char*)instances->positions + positionSize(instances, instances->capacity));
+	}
+	return true;
+}
+
+static void updateRegionStatics(struct InstanceBuffers* instances, int region) {
+	/* Brings the static buffer of region up to date with static_copy. The
+	 * GPU is done with it, the upload thread waited for its last draw.
+	 */
+	int capacity = instances->static_copy_capacity;
+	if (instances->region_static_capacities[region] < capacity) {
+		growStaticBuffer(&instances->region_statics[region], 
+			instances->region_static_capacities[region] * sizeof(struct StaticInstance),
+			capacity * sizeof(struct StaticInstance));
+		instances->region_static_capacities[region] = capacity;
+	}
+
+	int begin = instances->region_dirty_begin[region];
+	int end = instances->region_dirty_end[region] < capacity ? instances->region_dirty_end[region] : capacity;
+	if (begin < end) {
+		glBindBuffer(GL_ARRAY_BUFFER, instances->region_statics[region]);
+		glBufferSubData(GL_ARRAY_BUFFER, begin * sizeof(struct StaticInstance),
+			(end - begin) * sizeof(struct StaticInstance), instances->static_copy + begin);
+	}
+	instances->region_dirty_begin[region] = instances->region_dirty_end[region] = 0;
+}
+
+int endInstanceUpload(struct InstanceBuffers* instances) {
+	/* Ends writing. Returns how many particles can be drawn, which is 0 if
+	 * the upload failed or the driver lost the mapped memory. With 
+	 * UPLOAD_THREAD they are the ones of draw_region.
+	 */
+	bool ok = instances->positions != NULL;
+	instances->draw_region = instances->region;
+
+	instances->statics = NULL;
+	if (instances->mode == UPLOAD_THREAD) {
+		instances->positions = NULL;
+		instances->draw_region = -1;
+		if (!ok)
+			return 0;
+
+		instances->region_counts[instances->region] = instances->count;
+		if (!instances->stream_static)
+			updateRegionStatics(instances, instances->region);
+		instances->draw_region = endUploadBuffer(instances->upload, instances->region, 
+			writtenSize(instances, instances->count), &instances->fence_wait_ms);
+		if (instances->draw_region < 0)
+			return 0;
+
+		// The buffer drawn may be laid out for a capacity from before a grow
+		instances->position_buffer = uploadBufferName(instances->upload, instances->draw_region);
+		instances->position_offset = 0;
+		instances->static_offset = positionSize(instances, 
+			instances->region_capacities[instances->draw_region]);
+		if (!instances->stream_static)
+			instances->static_buffer = instances->region_statics[instances->draw_region];
+		pointPositions(instances, 0);
+		pointStatic(instances, 0);
+		return instances->region_counts[instances->draw_region];
+	}
+
+	// The persistent ring is coherent and stays mapped, but the attribute
+	// has to follow it to this frame's region
+	if (ok && instances->mode == UPLOAD_MAP) {
+		glBindBuffer(GL_ARRAY_BUFFER, instances->position_buffer);
+		ok = glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE;
+	} else if (ok) {
+		pointPositions(instances, 0);
+		if (instances->stream_static)
+			pointStatic(instances, 0);
+	}
+
+	instances->positions = NULL;
+	return ok ? instances->count : 0;
+}
+
+void fenceInstanceUpload(struct InstanceBuffers* instances) {
+	/* Call after the draws that read this frame's region, every frame.
+	 */
+	if (instances->mode == UPLOAD_THREAD && instances->draw_region >= 0) {
+		fenceUploadBuffer(instances->upload, instances->draw_region);
+		instances->draw_region = -1;
+	}
+	if (instances->mode != UPLOAD_PERSISTENT)
+		return;
+
+	if (instances->fences[instances->region] != NULL)
+		glDeleteSync(instances->fences[instances->region]);
+	instances->fences[instances->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void uploadInstanceStatic(struct InstanceBuffers* instances, int base, const float* size, const uint32_t* color, int begin, int end) {
+	/* Uploads size and color of the slots [begin, end) to the instances from
+	 * base on, within the capacity of the last beginInstanceUpload. Does 
+	 * nothing with stream_static, the frames write them then.
+	 */
+	if (instances->stream_static)
+		return;
+	int capacity = instances->mode == UPLOAD_THREAD ? instances->static_copy_capacity : instances->capacity;
+	if (base + end > capacity)
+		end = capacity - base;
+	if (begin >= end)
+		return;
+
+	// Every region has to catch up on these slots when it is written next
+	if (instances->mode == UPLOAD_THREAD) {
+		for (int i = begin; i < end; ++i) {
+			instances->static_copy[base + i].size = size[i];
+			instances->static_copy[base + i].color = color[i];
+		}
+		for (int r = 0; r < INSTANCE_MAX_REGIONS; ++r) {
+			if (instances->region_dirty_begin[r] >= instances->region_dirty_end[r]) {
+				instances->region_dirty_begin[r] = base + begin;
+				instances->region_dirty_end[r] = base + end;
+			} else {
+				if (base + begin < instances->region_dirty_begin[r])
+					instances->region_dirty_begin[r] = base + begin;
+				if (base + end > instances->region_dirty_end[r])
+					instances->region_dirty_end[r] = base + end;
+			}
+		}
+		return;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, instances->static_buffer);
+	struct StaticInstance* out = glMapBufferRange(
+		GL_ARRAY_BUFFER, 
+		(base + begin) * sizeof(struct StaticInstance), 
+		(end - begin) * sizeof(struct StaticInstance), 
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT
+	);
+	if (out == NULL) {
+		fprintf(stderr, "Could not map the static instance buffer\n");
+		return;
+	}
+
+	for (int i = begin; i < end; ++i) {
+		out[i - begin].size = size[i];
+		out[i - begin].color = color[i];
+	}
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+}
+
+bool bindInstanceTextures(struct InstanceBuffers* instances, int position_unit, int static_unit) {
+	/* Binds texture buffers over the instance buffers to the units, for
+	 * fetching by gl_InstanceID. Returns false if they are too big for a
+	 * texture buffer, or with stream_static.
+	 */
+	if (instances->stream_static)
+		return false;
+
+	if (instances->position_texture == 0) {
+		glGenTextures(1, &instances->position_texture);
+		glGenTextures(1, &instances->static_texture);
+		glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &instances->max_texels);
+	}
+
+	int regions = instances->mode == UPLOAD_PERSISTENT ? INSTANCE_REGIONS : 1;
+	long texels = (long)instances->capacity * regions * position_texels[instances->format];
+	if (texels > instances->max_texels || instances->capacity > instances->max_texels)
+		return false;
+
+	glActiveTexture(GL_TEXTURE0 + position_unit);
+	glBindTexture(GL_TEXTURE_BUFFER, instances->position_texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, position_texture_formats[instances->format], instances->position_buffer);
+
+	// size is read as the bits of a uint, color as 4 bytes in one
+	glActiveTexture(GL_TEXTURE0 + static_unit);
+	glBindTexture(GL_TEXTURE_BUFFER, instances->static_texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, instances->static_buffer);
+
+	glActiveTexture(GL_TEXTURE0);
+	return true;
+}
+
+void instanceTextureLayout(const struct InstanceBuffers* instances, int* base, int* texels) {
+	/* The first texel of this frame's positions in the position texture, 
+	 * and how many texels each particle takes.
+	 */
+	*texels = position_texels[instances->format];
+	*base = (int)(instances->position_offset / positionStride(instances->format)) * *texels;
+}
+
+void drawInstanceRanges(struct InstanceBuffers* instances, GLenum primitive, int vertices, const int* first, const int* count, int ranges) {
+	/* Draws range i as count[i] particles from first[i] on, each one an
+	 * instance of vertices vertices, or one vertex with a divisor of 0. All
+	 * in one indirect call with multi_draw, else a draw per range.
+	 */
+	if (instances->multi_draw) {
+		if (ranges > instances->draw_capacity) {
+			free(instances->draw_commands);
+			instances->draw_capacity = ranges * 2;
+			instances->draw_commands = malloc(sizeof(struct DrawCommand) * instances->draw_capacity);
+		}
+
+		for (int i = 0; i < ranges; ++i) {
+			struct DrawCommand* command = &instances->draw_commands[i];
+			if (instances->divisor == 0) {
+				*command = (struct DrawCommand){count[i], 1, first[i], 0};
+			} else {
+				*command = (struct DrawCommand){vertices, count[i], 0, first[i]};
+			}
+		}
+
+		if (instances->indirect_buffer == 0)
+			glGenBuffers(1, &instances->indirect_buffer);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, instances->indirect_buffer);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(struct DrawCommand) * ranges, 
+			instances->draw_commands, GL_STREAM_DRAW);
+		glMultiDrawArraysIndirect(primitive, (void*)0, ranges, 0);
+		return;
+	}
+
+	for (int i = 0; i < ranges; ++i) {
+		if (count[i] == 0)
+			continue;
+		if (instances->divisor == 0) {
+			glDrawArrays(primitive, first[i], count[i]);
+			continue;
+		}
+		pointPositions(instances, first[i]);
+		pointStatic(instances, first[i]);
+		glDrawArraysInstanced(primitive, 0, vertices, count[i]);
+	}
+	if (instances->divisor != 0) {
+		pointPositions(instances, 0);
+		pointStatic(instances, 0);
+	}
+}
@@ -0,0 +1,115 @@
+#ifndef INSTANCES_H
+#define INSTANCES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+#include "particles.h"
+#include "upload.h"
+
+#define INSTANCE_REGIONS 3
+
+// Vertex attribute locations in res/particles_vert.glsl
+#define INSTANCE_POSITION_ATTRIBUTE 1
+#define INSTANCE_COLOR_ATTRIBUTE 2
+#define INSTANCE_SIZE_ATTRIBUTE 3
+
+// How the instance buffers get to the GPU
+enum UploadMode {
+	UPLOAD_MAP,        // Map with invalidate every frame, works everywhere
+	UPLOAD_PERSISTENT, // Ring of persistently mapped regions, GL 4.4
+	UPLOAD_THREAD,     // Mapped on a thread of its own, drawn a frame late
+};
+
+// Most regions a frame can write or draw, see region and draw_region
+#define INSTANCE_MAX_REGIONS UPLOAD_THREAD_BUFFERS
+
+/* The per particle instance buffers. Positions are mapped for any thread to
+ * write between beginInstanceUpload and endInstanceUpload, sizes and colors
+ * only go up where they changed. Keep the vertex array bound at creation.
+ */
+struct InstanceBuffers {
+	enum UploadMode mode;
+	enum PositionFormat format;
+	uint32_t position_buffer;
+	uint32_t static_buffer;
+	int capacity;
+	bool stream_static; // Sizes and colors follow every frame's positions
+	int divisor; // 1 advances per instance, 0 per vertex for points
+
+	// Mapped for the current frame, NULL otherwise
+	void* positions;
+	struct StaticInstance* statics; // With stream_static
+	int count;
+	size_t position_offset;
+	size_t static_offset; // With stream_static, in position_buffer
+
+	// UPLOAD_PERSISTENT: the whole ring stays mapped, each region is fenced
+	// after the frame that draws from it
+	int region;
+	GLsync fences[INSTANCE_REGIONS];
+	char* ring;
+
+	// UPLOAD_THREAD: region is the buffer the frame writes, draw_region the
+	// one it draws, usually the one written the frame before. -1 if none.
+	// Every other mode draws the region it writes.
+	struct UploadThread* upload;
+	int draw_region;
+	int region_counts[INSTANCE_MAX_REGIONS];
+	int region_capacities[INSTANCE_MAX_REGIONS]; // Where the statics start
+
+	// UPLOAD_THREAD without stream_static: every region has a static buffer
+	// of its own, brought up to date from static_copy by the frame writing
+	// it. static_buffer is the one of draw_region.
+	uint32_t region_statics[INSTANCE_MAX_REGIONS];
+	int region_static_capacities[INSTANCE_MAX_REGIONS];
+	int region_dirty_begin[INSTANCE_MAX_REGIONS], region_dirty_end[INSTANCE_MAX_REGIONS];
+	struct StaticInstance* static_copy;
+	int static_copy_capacity;
+
+	double fence_wait_ms; // Waited in the last beginInstanceUpload
+
+	// Texture buffer views of the same buffers for vertex pulling, made by
+	// the first bindInstanceTextures
+	uint32_t position_texture;
+	uint32_t static_texture;
+	int max_texels;
+
+	// drawInstanceRanges records one command per range here and draws them
+	// all with glMultiDrawArraysIndirect if multi_draw is set
+	bool multi_draw;
+	uint32_t indirect_buffer;
+	struct DrawCommand* draw_commands;
+	int draw_capacity;
+};
+
+// glMultiDrawArraysIndirect's command layout
+struct DrawCommand {
+	uint32_t count;
+	uint32_t instance_count;
+	uint32_t first;
+	uint32_t base_instance;
+};
+
+struct StaticInstance {
+	float size;
+	uint32_t color; // PACK_RGBA
+};
+
+void createInstanceBuffers(struct InstanceBuffers* instances, int capacity, enum UploadMode mode, enum PositionFormat format, bool stream_static);
+void destroyInstanceBuffers(struct InstanceBuffers* instances);
+
+bool beginInstanceUpload(struct InstanceBuffers* instances, int count, int capacity);
+int endInstanceUpload(struct InstanceBuffers* instances);
+void fenceInstanceUpload(struct InstanceBuffers* instances);
+void setupInstanceStaticAttributes(const struct InstanceBuffers* instances);
+void setInstanceDivisor(struct InstanceBuffers* instances, int divisor);
+void uploadInstanceStatic(struct InstanceBuffers* instances, int base, const float* size, const uint32_t* color, int begin, int end);
+void drawInstanceRanges(struct InstanceBuffers* instances, GLenum primitive, int vertices, const int* first, const int* count, int ranges);
+bool bindInstanceTextures(struct InstanceBuffers* instances, int position_unit, int static_unit);
+void instanceTextureLayout(const struct InstanceBuffers* instances, int* base, int* texels);
+
+#endif
@@ -0,0 +1,160 @@
+/* The level of detail grid. Cells are found by linear probing from a hash
+ * of their coordinates, and the table doubles before it is half full.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "lod.h"
+
+static uint32_t hashCell(int32_t x, int32_t y, int32_t z) {
+	uint32_t h = (uint32_t)x * 0x9E3779B1u ^ (uint32_t)y * 0x85EBCA77u ^ (uint32_t)z * 0xC2B2AE3Du;
+	return h ^ h >> 15;
+}
+
+void createLodGrid(struct LodGrid* grid) {
+	/* An empty grid, the table is allocated when the first cell comes.
+	 */
+	memset(grid, 0, sizeof(*grid));
+	grid->cell = 1.0f;
+	grid->stamp = 1;
+}
+
+void destroyLodGrid(struct LodGrid* grid) {
+	free(grid->table);
+	free(grid->used);
+}
+
+void clearLodGrid(struct LodGrid* grid, float cell) {
+	/* Empties the grid and sets the cell size for what is added next.
+	 */
+	grid->cell = cell;
+	grid->count = 0;
+	if (++grid->stamp == 0) {
+		// Wrapped, a stale cell could look like a new one
+		if (grid->table != NULL)
+			memset(grid->table, 0, sizeof(struct LodCell) * grid->capacity);
+		grid->stamp = 1;
+	}
+}
+
+static bool growLodGrid(struct LodGrid* grid) {
+	int capacity = grid->capacity > 0 ? grid->capacity * 2 : 256;
+	struct LodCell* table = calloc(capacity, sizeof(struct LodCell));
+	int* used = malloc(sizeof(int) * capacity);
+	if (table == NULL || used == NULL) {
+		free(table);
+		free(used);
+		return false;
+	}
+
+	// Moved in the order they came, so the order stays the same
+	uint32_t mask = capacity - 1;
+	for (int k = 0; k < grid->count; ++k) {
+		const struct LodCell* cell = &grid->table[grid->used[k]];
+		uint32_t at = hashCell(cell->x, cell->y, cell->z) & mask;
+		while (table[at].stamp == grid->stamp)
+			at = (at + 1) & mask;
+		table[at] = *cell;
+		used[k] = at;
+	}
+
+	free(grid->table);
+	free(grid->used);
+	grid->table = table;
+	grid->used = used;
+	grid->capacity = capacity;
+	return true;
+}
+
+static struct LodCell* findCell(struct LodGrid* grid, int32_t x, int32_t y, int32_t z) {
+	/* Returns the cell x y z, a new empty one if the grid does not have it
+	 * yet. NULL if it would not fit and the table could not grow.
+	 */
+	if (2 * (grid->count + 1) > grid->capacity && !growLodGrid(grid) && grid->count + 1 >= grid->capacity)
+		return NULL;
+
+	uint32_t mask = grid->capacity - 1;
+	for (uint32_t at = hashCell(x, y, z) & mask;; at = (at + 1) & mask) {
+		struct LodCell* cell = &grid->table[at];
+		if (cell->stamp != grid->stamp) {
+			*cell = (struct LodCell){ .x = x, .y = y, .z = z, .stamp = grid->stamp };
+			grid->used[grid->count++] = at;
+			return cell;
+		}
+		if (cell->x == x && cell->y == y && cell->z == z)
+			return cell;
+	}
+}
+
+void addLodParticle(struct LodGrid* grid, const float p[3], float size, uint32_t color) {
+	/* Adds a particle at p to the cell it is in. p has to be finite,
+	 * particles billions of cells out share the cells at the edge.
+	 */
+	float scale = 1.0f / grid->cell;
+	int32_t c[3];
+	for (int k = 0; k < 3; ++k) {
+		float f = floorf(p[k] * scale);
+		c[k] = (int32_t)(f < -1e9f ? -1e9f : (f > 1e9f ? 1e9f : f));
+	}
+
+	struct LodCell* cell = findCell(grid, c[0], c[1], c[2]);
+	if (cell == NULL)
+		return;
+	++cell->count;
+	cell->size += size;
+	for (int k = 0; k < 3; ++k)
+		cell->position[k] += p[k];
+	for (int k = 0; k < 4; ++k)
+		cell->color[k] += (float)(color >> 8*k & 0xFF);
+}
+
+void mergeLodGrid(struct LodGrid* grid, const struct LodGrid* other) {
+	/* Adds the cells of other to grid. Both have to have the same cell size.
+	 */
+	for (int k = 0; k < other->count; ++k) {
+		const struct LodCell* from = &other->table[other->used[k]];
+		struct LodCell* to = findCell(grid, from->x, from->y, from->z);
+		if (to == NULL)
+			continue;
+		to->count += from->count;
+		to->size += from->size;
+		for (int c = 0; c < 3; ++c)
+			to->position[c] += from->position[c];
+		for (int c = 0; c < 4; ++c)
+			to->color[c] += from->color[c];
+	}
+}
+
+void packImpostors(const struct LodGrid* grid, int begin, int end, bool premultiplied,
+		enum PositionFormat format, const float bounds[6], void* positions, uint32_t* statics) {
+	/* Writes an impostor for each of the cells [begin, end) to slots 0, 1,
+	 * ... like packVisible, at the average position and color of the cell.
+	 * It covers and is as opaque as its particles together, up to the cell.
+	 */
+	for (int k = begin; k < end; ++k) {
+		const struct LodCell* cell = &grid->table[grid->used[k]];
+		float n = (float)cell->count;
+		float p[3] = {cell->position[0] / n, cell->position[1] / n, cell->position[2] / n};
+		float size = cell->size / n;
+		float alpha = cell->color[3] / n / 255.0f;
+
+		float grown = size * sqrtf(n);
+		if (grown > grid->cell)
+			grown = size > grid->cell ? size : grid->cell;
+		float layers = grown > 0.0f ? n * size * size / (grown * grown) : 1.0f;
+		float opacity = alpha < 1.0f ? 1.0f - powf(1.0f - alpha, layers) : 1.0f;
+		float tint = premultiplied && alpha > 0.0f ? opacity / alpha : 1.0f;
+
+		uint32_t rgba[4];
+		for (int c = 0; c < 4; ++c) {
+			float value = c < 3 ? cell->color[c] / n * tint : opacity * 255.0f;
+			rgba[c] = (uint32_t)(value > 255.0f ? 255.0f : value + 0.5f);
+		}
+
+		int slot = k - begin;
+		packPoint(p, format, bounds, positions, slot);
+		memcpy(statics + 2*slot, &grown, sizeof(float));
+		statics[2*slot+1] = PACK_RGBA(rgba[0], rgba[1], rgba[2], rgba[3]);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "particles.h"
+
+/* Far particles summed up per cell of a grid of cubes, into one impostor
+ * each. A grid hashes only the cells in use, every update job fills one and
+ * mergeLodGrid adds them up. Clearing bumps stamp, older cells count as empty.
+ */
+struct LodCell {
+	int32_t x, y, z; // Which cell, in cells from the origin
+	uint32_t stamp;
+	uint32_t count;
+	float size;
+	float position[3];
+	float color[4]; // r g b a, 0 to 255 each
+};
+
+struct LodGrid {
+	float cell; // How big the cells are
+	uint32_t stamp;
+	int count; // Cells in use
+	int capacity; // Of table, a power of two
+	struct LodCell* table;
+	int* used; // Where in table the cells in use are, in the order they came
+};
+
+void createLodGrid(struct LodGrid* grid);
+void destroyLodGrid(struct LodGrid* grid);
+void clearLodGrid(struct LodGrid* grid, float cell);
+void addLodParticle(struct LodGrid* grid, const float p[3], float size, uint32_t color);
+void mergeLodGrid(struct LodGrid* grid, const struct LodGrid* other);
+void packImpostors(const struct LodGrid* grid, int begin, int end, bool premultiplied,
+	enum PositionFormat format, const float bounds[6], void* positions, uint32_t* statics);
+
+#endif
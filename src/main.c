@@ -9,8 +9,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <math.h>
+#include <float.h>
 #include <time.h>
+#include <inttypes.h>
 
 #include <GL/glew.h>
 #include <GL/gl.h>
@@ -20,6 +23,15 @@
 #include <cglm/cglm.h>
 
 #include "shader.h"
+#include "particles.h"
+#include "threadpool.h"
+#include "options.h"
+#include "instances.h"
+#include "feedback.h"
+#include "compute.h"
+#include "sort.h"
+#include "oit.h"
+#include "lod.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -29,7 +41,98 @@ void debugCallback(GLenum source, GLenum type, GLuint id,
    GLenum severity, GLsizei length, const GLchar* message, const void* userParam);
 #endif
 
-float rand_float();
+// One emitter and its particles. Every system has a range of the instance
+// arena to itself, starting at base, and is drawn as one range of it.
+struct System {
+	struct ParticleSystem* particles;
+	struct Emitter emitter;
+	uint64_t seed; // Of the emitter and the first particles
+	int base;
+};
+
+// Everything the update jobs of one system need for one frame
+struct FrameUpdate {
+	struct ParticleSystem* particles;
+	int steps;
+	float accel, dt; // Per step
+	float alpha;
+	enum PositionFormat format;
+	void* positions; // Mapped GL buffer, at the system's base
+
+	// POSITION_UNORM16 only: the box of every chunk of the system, then of
+	// all particles of all systems
+	int chunk;
+	float (*chunk_bounds)[6];
+	float bounds[6];
+
+	// With --cull: the view frustum, where the sizes and colors go (at the
+	// system's base) and how many particles of every chunk were visible
+	const struct ParticleCull* cull;
+	uint32_t* statics;
+	int* chunk_visible;
+
+	// With --sort: the depth keys at the system's base and the view matrix
+	// row they come from. positions are then the sort's, not mapped.
+	uint32_t* keys;
+	const float* depth;
+
+	// With --lod: where particles become impostors, and the grid of every
+	// chunk the far ones go to. cull is set then too.
+	const struct ParticleLod* lod;
+	struct LodGrid* lod_grids;
+};
+void update_range(void* data, int begin, int end);
+void quantize_range(void* data, int begin, int end);
+int pack_visible(struct FrameUpdate* frame, int begin, int end);
+
+// Instance ranges to draw, one per system, or one per chunk when culling
+// packs the visible particles of every chunk to its front
+struct DrawRanges {
+	int ranges;
+	int capacity;
+	int* first;
+	int* count;
+};
+void reserve_ranges(struct DrawRanges* draw, int ranges);
+
+// The update jobs of a frame and what they write per chunk
+struct FrameChunks {
+	int capacity;
+	struct Job* jobs;
+	float (*bounds)[6];
+	int* first; // In the arena
+	int* visible;
+};
+void reserve_chunks(struct FrameChunks* chunks, int count);
+
+// Sorted instances copied into the mapped buffers by jobs
+struct SortGather {
+	const struct DepthSort* sort;
+	void* positions;
+	uint32_t* statics;
+};
+void gather_range(void* data, int begin, int end);
+
+// A first population filled in chunks by jobs
+struct ParticleInit {
+	struct ParticleSystem* particles;
+	const struct Emitter* emitter;
+	uint64_t seed;
+};
+void init_range(void* data, int begin, int end);
+
+// An image read from disk by a job
+struct ImageLoad {
+	const char* path;
+	int width, height, comp;
+	bool premultiply; // Multiply the colors by alpha
+	unsigned char* pixels;
+};
+void load_image(void* data, int begin, int end);
+
+float verify_gpu(const struct Options* options, struct FeedbackSim* feedback, 
+	struct ComputeSim* compute, struct ParticleSystem* particles);
+float verify_simd(const struct System* systems, int system_count, float accel);
 
 // A quad to be rendered as particle of length 12
 static const float g_vertex_buffer_data[] = {
@@ -39,17 +142,21 @@ static const float g_vertex_buffer_data[] = {
 	 0.5f,  0.5f, 0.0f,
 };
 
-struct Particle {
-	vec3 pos, speed;
-	unsigned char r,g,b,a;
-	float size;
-};
-// This can be increased to about 100 000 with about 60% cpu usage
-const int max_particles = 50000; 
 const float particle_accel = 0.00001f;
 const float particle_init_speed = 0.07f;
+const float particle_tick = 1000.0f/60.0f; // Speeds are in units per tick (ms)
+const int max_sim_steps = 8; // Per frame, slow frames drop time beyond this
+const int particle_init_chunk = 16384; // Particles made per startup job
+const int particle_init_per_thread = 4; // Startup jobs queued at a time
+const float system_spacing = 2.0f; // Between the emitters of --systems
 const float particle_size = 0.025f;
+const int verify_simd_particles = 65536; // Per system and check
 const char particle_color[4] = {255, 255, 255, 170}; // r g b a
+const float lod_cell_scale = 1.0f / 16.0f; // Impostor grid cells, of the --lod distance
+
+// Texture units of the vertex pulling renderer, the particle image is on 0
+const int pull_position_unit = 1;
+const int pull_static_unit = 2;
 
 const float fov = 0.7f;
 const float movespeed = 0.005f;
@@ -61,7 +168,14 @@ int main(int argc, char* argv[]) {
 	int window_width = 640;
 	int window_height = 480;
 
-	srand(time(NULL));
+	struct Options options;
+	if (!parseOptions(&options, argc, argv))
+		return 1;
+
+	// Print the seed so a run can be repeated with --seed
+	if (!options.has_seed)
+		options.seed = (uint64_t)time(NULL);
+	printf("Seed %" PRIu64 "\n", options.seed);
 
 	freopen("error.log", "w", stderr);
 
@@ -71,6 +185,11 @@ int main(int argc, char* argv[]) {
 		fprintf(stderr, "Failed to init SDL: %s\n", SDL_GetError());
 	}
 
+	// Created once, every frame stage is split into jobs for these threads
+	if (options.threads == 0)
+		options.threads = SDL_GetCPUCount();
+	struct ThreadPool* pool = createThreadPool(options.threads);
+
 	window = SDL_CreateWindow(
 		"Particles",
 		SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
@@ -83,7 +202,9 @@ int main(int argc, char* argv[]) {
 	}
 	SDL_SetRelativeMouseMode(SDL_TRUE);
 
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+	// Compute shaders need 4.3, everything else runs on 3.3
+	bool want_compute = options.backend == BACKEND_COMPUTE;
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, want_compute ? 4 : 3);
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
 
 	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
@@ -93,6 +214,12 @@ int main(int argc, char* argv[]) {
 	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 4);
 
 	context = SDL_GL_CreateContext(window);
+	if (context == NULL && want_compute) {
+		fprintf(stderr, "No OpenGL 4.3 context, simulating on the CPU\n");
+		options.backend = BACKEND_CPU;
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+		context = SDL_GL_CreateContext(window);
+	}
 	if (context == NULL) {
 		fprintf(stderr, "Could not create OpenGL context: %s\n", SDL_GetError());
 	}
@@ -108,34 +235,181 @@ int main(int argc, char* argv[]) {
 
 	glEnable(GL_MULTISAMPLE);
 	
+	// The additive and premultiplied modes draw premultiplied colors, the 
+	// sprite and the particle color are multiplied by their alpha at load.
+	// Adding them up does not depend on the order, so it needs no sort.
+	bool premultiplied = options.blend == BLEND_ADDITIVE || options.blend == BLEND_PREMULTIPLIED;
 	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // Gives alpha to particles
+	if (options.blend == BLEND_ADDITIVE)
+		glBlendFunc(GL_ONE, GL_ONE);
+	else if (options.blend == BLEND_PREMULTIPLIED)
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	else
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // Gives alpha to particles
 
 	// GL setup
 	// --------
+
+	// Weighted blended OIT draws into targets of its own and every program
+	// that draws particles writes to them with its variant of the shader
+	struct OitTarget oit;
+	if (options.blend == BLEND_OIT && !createOitTarget(&oit, window_width, window_height)) {
+		fprintf(stderr, "No OIT targets, blending in order\n");
+		options.blend = BLEND_ALPHA;
+	}
+	const char* particle_fragment = options.blend == BLEND_OIT 
+		? "res/particles_oit_frag.glsl" : "res/particles_frag.glsl";
 	
-	uint32_t program = createProgramVF("res/particles_vert.glsl","res/particles_frag.glsl");
+	uint32_t program = createProgramVF("res/particles_vert.glsl", particle_fragment);
 
 	uint32_t vao;
 	glGenVertexArrays(1, &vao);
 	glBindVertexArray(vao);
 
 	uint32_t particle_vertex_buffer;
-	uint32_t particle_position_buffer;
-	uint32_t particle_color_buffer;
 
 	glGenBuffers(1, &particle_vertex_buffer);
 	glBindBuffer(GL_ARRAY_BUFFER, particle_vertex_buffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(g_vertex_buffer_data), g_vertex_buffer_data, GL_STATIC_DRAW);
 
-	glGenBuffers(1, &particle_position_buffer);
-	glBindBuffer(GL_ARRAY_BUFFER, particle_position_buffer);
-	glBufferData(GL_ARRAY_BUFFER, max_particles*4*sizeof(float), NULL, GL_STATIC_DRAW);
-	
+	// The vertex array keeps all attribute state, so it is set up once here
+	// and stays bound. The quad's corners advance per vertex, everything 
+	// else per instance.
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(
+		0,
+		3,
+		GL_FLOAT,
+		GL_FALSE,
+		0,
+		(void*)0
+	);
+	glVertexAttribDivisor(0, 0); // Docs: https://docs.gl/gl3/glVertexAttribDivisor
 
-	glGenBuffers(1, &particle_color_buffer);
-	glBindBuffer(GL_ARRAY_BUFFER, particle_color_buffer);
-	glBufferData(GL_ARRAY_BUFFER, max_particles*4*sizeof(unsigned char), NULL, GL_STATIC_DRAW);
+	// The GPU backends keep their own positions, in floats
+	bool on_gpu = options.backend != BACKEND_CPU;
+	if (on_gpu && options.position_format != POSITION_FLOAT) {
+		fprintf(stderr, "The GPU backends draw float positions\n");
+		options.position_format = POSITION_FLOAT;
+	}
+	if (on_gpu && options.systems > 1) {
+		fprintf(stderr, "The GPU backends run one system\n");
+		options.systems = 1;
+	}
+	if (on_gpu && (options.emit_rate > 0 || options.lifetime > 0)) {
+		fprintf(stderr, "The GPU backends keep their first particles, no emitting\n");
+		options.emit_rate = 0;
+		options.lifetime = 0;
+	}
+	if (on_gpu && options.cull) {
+		fprintf(stderr, "The GPU backends draw every particle, no culling\n");
+		options.cull = false;
+	}
+	if (on_gpu && options.sort) {
+		fprintf(stderr, "The GPU backends draw in storage order, no sorting\n");
+		options.sort = false;
+	}
+	if (on_gpu && options.lod > 0.0f) {
+		fprintf(stderr, "The GPU backends draw every particle, no impostors\n");
+		options.lod = 0.0f;
+	}
+	if (on_gpu && options.upload == UPLOAD_THREAD) {
+		fprintf(stderr, "The GPU backends draw from one static buffer, uploading by mapping\n");
+		options.upload = UPLOAD_MAP;
+	}
+	if (options.lod > 0.0f && options.sort) {
+		fprintf(stderr, "Impostors are drawn unsorted, not sorting\n");
+		options.sort = false;
+	}
+	if (options.blend == BLEND_ADDITIVE && options.sort) {
+		fprintf(stderr, "Additive blending does not depend on the order, no sorting\n");
+		options.sort = false;
+	}
+
+	// Back to front order, the update jobs write the keys
+	struct DepthSort depth_sort;
+	if (options.sort && !createDepthSort(&depth_sort, options.threads)) {
+		fprintf(stderr, "Could not allocate the depth sort, drawing unsorted\n");
+		options.sort = false;
+	}
+
+	// Far particles go to a grid per update chunk, the chunks' grids add 
+	// up to lod_cells. Kept for the next frames, more are made as needed.
+	struct LodGrid lod_cells;
+	struct LodGrid* lod_grids = NULL;
+	int lod_grid_count = 0;
+	createLodGrid(&lod_cells);
+
+	// Position, size and color per particle. Culling and sorting move 
+	// particles to other slots, so sizes and colors are streamed too.
+	struct InstanceBuffers instances;
+	createInstanceBuffers(&instances, options.capacity, options.upload, options.position_format, 
+		options.cull || options.sort || options.lod > 0.0f);
+	if (options.separate_draws)
+		instances.multi_draw = false;
+
+	struct FeedbackSim feedback;
+	struct ComputeSim compute;
+	if (options.backend == BACKEND_FEEDBACK
+			&& !createFeedbackSim(&feedback, options.capacity, particle_vertex_buffer, &instances)) {
+		fprintf(stderr, "Could not set up the feedback backend, simulating on the CPU\n");
+		options.backend = BACKEND_CPU;
+	}
+	if (options.backend == BACKEND_COMPUTE
+			&& !createComputeSim(&compute, options.capacity, options.workgroup, particle_vertex_buffer, 
+				&instances, particle_fragment)) {
+		fprintf(stderr, "Could not set up the compute backend, simulating on the CPU\n");
+		options.backend = BACKEND_CPU;
+	}
+	on_gpu = options.backend != BACKEND_CPU;
+	glBindVertexArray(vao);
+
+	// Packs the visible particles to the front of each chunk with their 
+	// sizes and colors, everything is visible without culling
+	bool compacting = options.cull || options.lod > 0.0f;
+
+	// The compute backend pulls positions in a vertex shader of its own
+	uint32_t draw_program = options.backend == BACKEND_COMPUTE ? compute.draw_program : program;
+
+	// The other renderers draw the same instance buffers with programs of
+	// their own, pulling by instance or reading attributes per vertex
+	uint32_t render_program = 0;
+	uint32_t pull_vao = 0;
+	int instance_base_location = -1;
+	if (on_gpu && options.renderer != RENDER_ATTRIBUTES) {
+		fprintf(stderr, "The GPU backends only draw with attributes\n");
+		options.renderer = RENDER_ATTRIBUTES;
+	}
+	if (options.blend == BLEND_OIT && options.renderer == RENDER_POINTS) {
+		fprintf(stderr, "Point sprites have no OIT shader, expanding them to quads instead\n");
+		options.renderer = RENDER_GEOMETRY;
+	}
+	if ((compacting || options.sort) && options.renderer == RENDER_PULL) {
+		fprintf(stderr, "Vertex pulling reads sizes and colors by slot, drawing with attributes\n");
+		options.renderer = RENDER_ATTRIBUTES;
+	}
+	if (options.renderer == RENDER_PULL) {
+		render_program = createProgramVF("res/particles_pull_vert.glsl", particle_fragment);
+		uniform1i(render_program, "positions", pull_position_unit);
+		uniform1i(render_program, "statics", pull_static_unit);
+		instance_base_location = glGetUniformLocation(render_program, "instanceBase");
+		glGenVertexArrays(1, &pull_vao);
+	} else if (options.renderer == RENDER_POINTS || options.renderer == RENDER_GEOMETRY) {
+		if (options.renderer == RENDER_POINTS) {
+			render_program = createProgramVF("res/points_vert.glsl", "res/points_frag.glsl");
+			glEnable(GL_PROGRAM_POINT_SIZE);
+		} else {
+			render_program = createProgramVGF("res/points_vert.glsl", "res/quad_geom.glsl", particle_fragment);
+		}
+		glDisableVertexAttribArray(0); // No quad, it would be read past its 4 corners
+		setInstanceDivisor(&instances, 0);
+	}
+	if (render_program != 0)
+		draw_program = render_program;
+
+	// Vertex shader runs per particle, for the vertices/s of --frames runs
+	int particle_vertices = options.renderer == RENDER_POINTS 
+		|| options.renderer == RENDER_GEOMETRY ? 1 : 4;
 
 	// Image
 	
@@ -148,42 +422,115 @@ int main(int argc, char* argv[]) {
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-	int width, height, comp;
+	// The particles and capacity are split evenly between the systems
+	int system_count = options.systems;
+	struct System* systems = malloc(sizeof(struct System) * system_count);
+	for (int s = 0; s < system_count; ++s) {
+		int capacity = options.capacity / system_count + (s < options.capacity % system_count);
+		systems[s].particles = createParticleSystem(capacity > 0 ? capacity : 1);
+		systems[s].base = 0;
+		if (systems[s].particles == NULL) {
+			fprintf(stderr, "Could not allocate %d particles\n", options.capacity);
+			return 1;
+		}
+	}
+
+	// The simulation runs in fixed steps, independent of the frame rate
+	double sim_step = 1000.0 / options.sim_rate; // in ms
+	double sim_accumulator = 0.0;
+	float sim_alpha = 1.0f;
+	int32_t sim_now = 0; // Steps run so far
+
+	const unsigned char* rgba = (const unsigned char*)particle_color;
+	const int color_scale = premultiplied ? rgba[3] : 255;
+	const uint32_t color = PACK_RGBA(
+		(rgba[0] * color_scale + 127) / 255, 
+		(rgba[1] * color_scale + 127) / 255, 
+		(rgba[2] * color_scale + 127) / 255, 
+		rgba[3]
+	);
+
+	// Draw ranges and unorm16 boxes for each region of the instance 
+	// buffers, the upload thread draws one packed in an earlier frame
+	struct DrawRanges draw_ranges[INSTANCE_MAX_REGIONS] = {{0}};
+	struct FrameChunks frame_chunks = {0};
+	struct FrameUpdate* frames = malloc(sizeof(struct FrameUpdate) * system_count);
+	int* sort_first = malloc(sizeof(int) * system_count);
+	int* sort_count = malloc(sizeof(int) * system_count);
+	vec3 region_origins[INSTANCE_MAX_REGIONS] = {{0}};
+	vec3 region_extents[INSTANCE_MAX_REGIONS];
+	for (int i = 0; i < INSTANCE_MAX_REGIONS; ++i)
+		glm_vec3_one(region_extents[i]);
+
+	// The emitters sit on a grid around the origin, one system is at it.
+	// Systems get a seed each so they do not all look the same.
+	int grid = (int)ceil(sqrt(system_count));
+	for (int s = 0; s < system_count; ++s) {
+		systems[s].seed = options.seed + (uint64_t)s * 0x9E3779B97F4A7C15ull;
+		systems[s].emitter = (struct Emitter){
+			.pos = {
+				(s % grid - (grid - 1) * 0.5f) * system_spacing, 
+				(s / grid - (grid - 1) * 0.5f) * system_spacing, 
+				0.0f
+			},
+			.spread = 1.0f,
+			.speed = particle_init_speed,
+			.rate = (float)options.emit_rate / system_count,
+			.lifetime = (int)ceil(options.lifetime / sim_step),
+			.size = particle_size,
+			.color = color,
+		};
+		seedRandomLanes(&systems[s].emitter.random, systems[s].seed, 0);
+	}
+
+	// The first particles are made in background chunks while the program
+	// runs, a few per thread at a time. Each frame draws the done prefix.
+	int init_chunk = particle_init_chunk;
+	int init_count = 0;
+	for (int s = 0; s < system_count; ++s) {
+		int particles = options.particles / system_count + (s < options.particles % system_count);
+		init_count += (particles + init_chunk - 1) / init_chunk;
+	}
+	int init_ready = 0; // Chunks
+	int init_queued = 0;
+	int init_window = threadCount(pool) * particle_init_per_thread;
+	struct Job* init_jobs = malloc(sizeof(struct Job)*(init_count + 1));
+	struct ParticleInit* inits = malloc(sizeof(struct ParticleInit)*system_count);
+	for (int s = 0, i = 0; s < system_count; ++s) {
+		inits[s] = (struct ParticleInit){
+			.particles = systems[s].particles,
+			.emitter = &systems[s].emitter,
+			.seed = systems[s].seed,
+		};
+		int particles = options.particles / system_count + (s < options.particles % system_count);
+		for (int begin = 0; begin < particles; begin += init_chunk, ++i) {
+			int end = begin + init_chunk < particles ? begin + init_chunk : particles;
+			initJob(&init_jobs[i], init_range, &inits[s], begin, end);
+		}
+	}
+	for (; init_queued < init_count && init_queued < init_window; ++init_queued)
+		if (!submitBackgroundJob(pool, &init_jobs[init_queued]))
+			break;
+
+	struct ImageLoad particle_image = { .path = "res/particle.png", .premultiply = premultiplied };
+	struct Job image_job;
 	stbi_set_flip_vertically_on_load(true);
-	unsigned char* particle_image = stbi_load("res/particle.png", &width, &height, &comp, 0);
+	initJob(&image_job, load_image, &particle_image, 0, 1);
+	submitJob(pool, &image_job);
 
+	waitJob(pool, &image_job);
 	glActiveTexture(GL_TEXTURE0);
 	glTexImage2D(
 		GL_TEXTURE_2D, 
 		0,
 		GL_RGBA,
-		width, height,
+		particle_image.width, particle_image.height,
 		0,
 		GL_RGBA,
 		GL_UNSIGNED_BYTE,
-		particle_image
+		particle_image.pixels
 	);
-
-	// Particle data
-	struct Particle* particle_container  = malloc(sizeof(struct Particle)*max_particles);
-	float* g_particle_position_size_data = malloc(sizeof(float)*4*max_particles);
-	unsigned char* g_particle_color_data = malloc(sizeof(char)*4*max_particles);
-
-	for (int i = 0; i < max_particles; ++i) {
-		struct Particle* pp = &particle_container[i];
-		pp->pos[0] = rand_float()-0.5f;
-		pp->pos[1] = rand_float()-0.5f;
-		pp->pos[2] = rand_float()-0.5f;
-		pp->size = particle_size;
-		pp->speed[0] = (rand_float()-0.5f)*particle_init_speed;
-		pp->speed[1] = (rand_float()-0.5f)*particle_init_speed;
-		pp->speed[2] = (rand_float()-0.5f)*particle_init_speed;
-
-		pp->r = particle_color[0];
-		pp->g = particle_color[1];
-		pp->b = particle_color[2];
-		pp->a = particle_color[3];
-	}
+	stbi_image_free(particle_image.pixels);
 
 	mat4 view = GLM_MAT4_IDENTITY_INIT;
 	mat4 proj = GLM_MAT4_IDENTITY_INIT;
@@ -202,6 +549,18 @@ int main(int argc, char* argv[]) {
 	uint64_t now_t = SDL_GetPerformanceCounter();
 	double delta_t = 1.0f;
 
+	// Frame time and time spent waiting on upload fences, shown in the
+	// title once a second
+	double stats_ms = 0.0, stats_fence_ms = 0.0;
+	int stats_frames = 0;
+	double run_ms = 0.0; // All frames, printed at the end of --frames runs
+	double run_vertices = 0.0;
+	double stats_sort_ms = 0.0, stats_sorted = 0.0; // Also for the title
+	double run_sort_ms = 0.0, run_sorted = 0.0;
+	int frame_number = 0;
+	float verify_error = 0.0f; // Worst seen
+	float simd_error = 0.0f;
+
 	// RUNNING
 	// =======
 	bool physics = true;
@@ -252,6 +611,8 @@ int main(int argc, char* argv[]) {
 						);
 
 						glViewport(0, 0, window_width, window_height);
+						if (options.blend == BLEND_OIT)
+							resizeOitTarget(&oit, window_width, window_height);
 					}
 					break;
 			}
@@ -293,142 +654,382 @@ int main(int argc, char* argv[]) {
 		glm_vec3_scale(move_dir, movespeed*delta_t, move_dir);
 		glm_vec3_add(camera_pos, move_dir, camera_pos);
 
+		// Camera matrix math, before the update so culling sees this frame
+		vec3 camera_right, camera_up;
+
+		// Calculate camera right
+		glm_vec3_copy((vec3){1.0f, 0.0f, 0.0f}, camera_right);
+		glm_vec3_rotate(camera_right, yaw, GLM_YUP);
+
+		// Calculate camera up
+		glm_vec3_copy(GLM_YUP, camera_up);
+		glm_vec3_rotate(camera_up, -pitch, camera_right);
+
+		glm_look(camera_pos, camera_dir, GLM_YUP, view);
+		glm_mat4_mul(proj, view, vp);
+
 		// UPDATE 
 		// ------
 
 		// Update all data for the particles
 		
-		int particle_count = 0;
-		for (int i = 0; i < max_particles; ++i) {
-			struct Particle* p = &particle_container[i];
+		// Run as many steps as fit in the time since the last frame. The
+		// rest is drawn by interpolating between the last two steps.
+		int steps = 0;
+		if (physics) {
+			sim_accumulator += delta_t;
+			steps = (int)(sim_accumulator / sim_step);
+			sim_accumulator -= steps * sim_step;
+			if (steps > max_sim_steps)
+				steps = max_sim_steps;
+			sim_alpha = (float)(sim_accumulator / sim_step);
+		}
 
-			if (physics) {
-			vec3 dir_to_middle;
-				glm_vec3_negate_to(p->pos, dir_to_middle);
+		// Free the slots of the particles that die during these steps and
+		// spawn the new ones, before the live range is split into chunks
+		if (init_ready < init_count) {
+			// Help out, with one thread nobody else would
+			runOneJob(pool);
+			for (; init_ready < init_count && jobDone(&init_jobs[init_ready]); ++init_ready) {
+				struct ParticleInit* init = init_jobs[init_ready].data;
+				struct ParticleSystem* ps = init->particles;
+				markParticlesDirty(ps, ps->count, init_jobs[init_ready].end);
+				ps->count = init_jobs[init_ready].end;
+			}
+			for (; init_queued < init_count && init_queued < init_ready + init_window; ++init_queued)
+				if (!submitBackgroundJob(pool, &init_jobs[init_queued]))
+					break;
+			if (init_ready == init_count) {
+				free(init_jobs);
+				free(inits);
+				init_jobs = NULL;
+				inits = NULL;
+			}
+		}
 
-				glm_vec3_normalize(dir_to_middle);
-				
-				glm_vec3_scale(dir_to_middle, particle_accel*delta_t, dir_to_middle);
+		// Slots past the prefix may still be written by the chunk jobs, so
+		// particles are only freed and spawned once all of them are done
+		if (steps > 0) {
+			sim_now += steps;
+			for (int s = 0; init_ready == init_count && s < system_count; ++s) {
+				removeDeadParticles(systems[s].particles, sim_now);
+				emitParticles(systems[s].particles, &systems[s].emitter, steps * sim_step, sim_now);
+			}
+		}
 
-				glm_vec3_add(p->speed, dir_to_middle, p->speed);
-				glm_vec3_add(p->speed, p->pos, p->pos);
+		// The systems sit in the arena one after the other with room for 
+		// their whole capacity, so only growing moves them. A system that
+		// moved uploads all of its sizes and colors again.
+		int arena_capacity = 0;
+		for (int s = 0; s < system_count; ++s) {
+			struct ParticleSystem* ps = systems[s].particles;
+			if (systems[s].base != arena_capacity) {
+				systems[s].base = arena_capacity;
+				markParticlesDirty(ps, 0, ps->count);
+			}
+			arena_capacity += ps->capacity;
+		}
+		struct System* last_system = &systems[system_count - 1];
+		int arena_count = last_system->base + last_system->particles->count;
+
+		// Sorting packs into arrays of its own first. A frame they can not
+		// grow for is drawn unsorted, compacted so it writes the statics.
+		bool sorting = options.sort && reserveDepthSort(&depth_sort, arena_capacity, 
+			positionStride(options.position_format));
+		if (options.sort && !sorting)
+			fprintf(stderr, "Could not grow the depth sort, drawing unsorted\n");
+		bool compact = compacting || options.sort != sorting;
+
+		// The jobs write straight into the mapped GL buffers, which also
+		// grow here if spawning grew the particles. With the GPU backend 
+		// they only step along to check it.
+		bool update = on_gpu 
+			? options.verify 
+			: beginInstanceUpload(&instances, arena_count, arena_capacity);
+
+		// Sizes and colors only go up for the slots that changed. A frame
+		// drawn unsorted keeps them dirty for the next sort's copy.
+		for (int s = 0; s < system_count; ++s) {
+			struct ParticleSystem* ps = systems[s].particles;
+			uploadInstanceStatic(&instances, systems[s].base, ps->size, ps->color,
+				ps->dirty_begin, ps->dirty_end);
+			if (sorting) {
+				copySortStatics(&depth_sort, systems[s].base, ps->size, ps->color,
+					ps->dirty_begin, ps->dirty_end);
 			}
+			if (sorting == options.sort)
+				clearParticlesDirty(ps);
+		}
 
-			g_particle_position_size_data[4*particle_count+0] = p->pos[0];
-			g_particle_position_size_data[4*particle_count+1] = p->pos[1];
-			g_particle_position_size_data[4*particle_count+2] = p->pos[2];
+		// New particles go to the GPU before anything steps them
+		struct ParticleSystem* gpu_particles = systems[0].particles;
+		if (options.backend == BACKEND_FEEDBACK)
+			uploadFeedbackSim(&feedback, gpu_particles, feedback.count, gpu_particles->count);
+		else if (options.backend == BACKEND_COMPUTE)
+			uploadComputeSim(&compute, gpu_particles, compute.count, gpu_particles->count);
 
-			g_particle_position_size_data[4*particle_count+3] = p->size;
+		// One job per chunk runs the steps and packs, with chunks sized over
+		// all systems. The frame job waits for them before unmapping.
+		int particle_count = 0;
+		for (int s = 0; s < system_count; ++s)
+			particle_count += systems[s].particles->count;
+		int chunk = rangeChunkSize(pool, update ? particle_count : 0, PARTICLE_ALIGN);
+		int chunk_count = 0;
+		for (int s = 0; update && s < system_count; ++s)
+			chunk_count += (systems[s].particles->count + chunk - 1) / chunk;
+
+		if (options.lod > 0.0f && chunk_count > lod_grid_count) {
+			struct LodGrid* grids = realloc(lod_grids, sizeof(struct LodGrid) * chunk_count);
+			if (grids == NULL) {
+				fprintf(stderr, "Could not allocate the impostor grids, drawing every particle\n");
+				options.lod = 0.0f;
+			} else {
+				lod_grids = grids;
+				for (; lod_grid_count < chunk_count; ++lod_grid_count)
+					createLodGrid(&lod_grids[lod_grid_count]);
+			}
+		}
 
-			g_particle_color_data[4*particle_count+0] = p->r;
-			g_particle_color_data[4*particle_count+1] = p->g;
-			g_particle_color_data[4*particle_count+2] = p->b;
-			g_particle_color_data[4*particle_count+3] = p->a;
-			
-			++particle_count;
+		float step_accel = particle_accel*sim_step;
+		float step_dt = sim_step/particle_tick;
+		reserve_chunks(&frame_chunks, chunk_count);
+		struct Job* update_jobs = frame_chunks.jobs;
+		struct Job frame_job;
+		float (*chunk_bounds)[6] = frame_chunks.bounds;
+		int* chunk_first = frame_chunks.first;
+		int* chunk_visible = frame_chunks.visible;
+
+		// The planes are in world space, so the particles need no transform
+		struct ParticleCull cull = {
+			.alpha = sim_alpha,
+			.format = options.position_format,
+		};
+		glm_frustum_planes(vp, cull.planes);
+
+		// Compacting without culling, everything is inside
+		if (!options.cull) {
+			for (int k = 0; k < 6; ++k)
+				glm_vec4_copy((vec4){0.0f, 0.0f, 0.0f, 1.0f}, cull.planes[k]);
+		}
+		struct ParticleLod lod = {
+			.distance = options.lod,
+			.cell = options.lod * lod_cell_scale,
+		};
+		glm_vec3_copy(camera_pos, lod.camera);
+
+		// View space z, the row of view that gives it
+		vec4 depth_row = {view[0][2], view[1][2], view[2][2], view[3][2]};
+		int stride = positionStride(options.position_format);
+
+		initJob(&frame_job, NULL, NULL, 0, 0);
+		for (int s = 0, i = 0; s < system_count; ++s) {
+			frames[s] = (struct FrameUpdate){
+				.particles = systems[s].particles,
+				.steps = steps,
+				.accel = step_accel,
+				.dt = step_dt,
+				.alpha = sim_alpha,
+				.format = options.position_format,
+				.positions = instances.positions == NULL ? NULL 
+					: sorting ? (char*)depth_sort.positions + systems[s].base * stride
+					: (char*)instances.positions + systems[s].base * stride,
+				.chunk = chunk,
+				.chunk_bounds = &chunk_bounds[i],
+				.cull = compact ? &cull : NULL,
+				.statics = instances.statics == NULL ? NULL 
+					: (uint32_t*)(instances.statics + systems[s].base),
+				.chunk_visible = &chunk_visible[i],
+				.keys = sorting ? depth_sort.keys + systems[s].base : NULL,
+				.depth = depth_row,
+				.lod = options.lod > 0.0f ? &lod : NULL,
+				.lod_grids = options.lod > 0.0f ? lod_grids + i : NULL,
+			};
+
+			int count = update ? systems[s].particles->count : 0;
+			for (int begin = 0; begin < count; begin += chunk, ++i) {
+				int end = begin + chunk < count ? begin + chunk : count;
+				chunk_first[i] = systems[s].base + begin;
+				chunk_visible[i] = 0;
+				initJob(&update_jobs[i], update_range, &frames[s], begin, end);
+				jobDependsOn(&frame_job, &update_jobs[i]);
+			}
 		}
+		for (int i = 0; i < chunk_count; ++i)
+			submitJob(pool, &update_jobs[i]);
+		submitJob(pool, &frame_job);
+		waitJob(pool, &frame_job);
+
+		// unorm16 needs the box of everything before any of it is packed
+		if (options.position_format == POSITION_UNORM16 && instances.positions != NULL) {
+			float bounds[6] = {FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX};
+			for (int i = 0; i < chunk_count; ++i) {
+				for (int k = 0; k < 3; ++k) {
+					bounds[k] = fminf(bounds[k], chunk_bounds[i][k]);
+					bounds[3 + k] = fmaxf(bounds[3 + k], chunk_bounds[i][3 + k]);
+				}
+			}
+			for (int s = 0; s < system_count; ++s)
+				memcpy(frames[s].bounds, bounds, sizeof(bounds));
+			cull.bounds = frames[0].bounds; // The same in every system
+
+			// Same chunks again, the update jobs are done and can be reused
+			for (int i = 0; i < chunk_count; ++i) {
+				struct Job* job = &update_jobs[i];
+				initJob(job, quantize_range, job->data, job->begin, job->end);
+				submitJob(pool, job);
+			}
+			for (int i = 0; i < chunk_count; ++i)
+				waitJob(pool, &update_jobs[i]);
 
-		// This is more effective than rewriting the buffer without reallocating it.
-		// Link to explanation: https://www.khronos.org/opengl/wiki/Buffer_Object_Streaming
-		//
-		glBindBuffer(GL_ARRAY_BUFFER, particle_position_buffer);
-		glBufferData(
-			GL_ARRAY_BUFFER, 
-			max_particles * 4 * sizeof(float), 
-			NULL, 
-			GL_STREAM_DRAW
-		); // Buffer orphaning
-		glBufferSubData(
-			GL_ARRAY_BUFFER, 
-			0, 
-			particle_count * sizeof(float) * 4, 
-			g_particle_position_size_data
-		);
-
-		glBindBuffer(GL_ARRAY_BUFFER, particle_color_buffer);
-		glBufferData(
-			GL_ARRAY_BUFFER, 
-			max_particles * 4 * sizeof(unsigned char), 
-			NULL, 
-			GL_STREAM_DRAW
-		); 
-		glBufferSubData(
-			GL_ARRAY_BUFFER, 
-			0, 
-			particle_count * sizeof(unsigned char) * 4, 
-			g_particle_color_data
-		);
-
-		// Push the Vertex Attrib Arrays
-		// -----------------------------
-		// 1st attribute buffer: vertices
-		glEnableVertexAttribArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, particle_vertex_buffer);
-		glVertexAttribPointer(
-			0,
-			3,
-			GL_FLOAT,
-			GL_FALSE,
-			0,
-			(void*)0
-		);
-
-		glEnableVertexAttribArray(1);
-		glBindBuffer(GL_ARRAY_BUFFER, particle_position_buffer);
-		glVertexAttribPointer(
-			1,
-			4,
-			GL_FLOAT,
-			GL_FALSE,
-			0,
-			(void*)0
-		);
-
-		glEnableVertexAttribArray(2);
-		glBindBuffer(GL_ARRAY_BUFFER, particle_color_buffer);
-		glVertexAttribPointer(
-			2,
-			4,
-			GL_UNSIGNED_BYTE,
-			GL_TRUE,
-			0,
-			(void*)0
-		);
-
-		// Camera matrix math
-		vec3 camera_right, camera_up;
+			for (int k = 0; k < 3; ++k) {
+				region_origins[instances.region][k] = bounds[k];
+				region_extents[instances.region][k] = bounds[3 + k] - bounds[k];
+			}
+		}
 
-		// Calculate camera right
-		glm_vec3_copy((vec3){1.0f, 0.0f, 0.0f}, camera_right);
-		glm_vec3_rotate(camera_right, yaw, GLM_YUP);
+		// The far particles of every chunk add up to an impostor per cell,
+		// packed into the slots they left free at the ends of the chunks
+		int impostor_count = 0;
+		if (options.lod > 0.0f && instances.positions != NULL) {
+			clearLodGrid(&lod_cells, lod.cell);
+			for (int i = 0; i < chunk_count; ++i)
+				mergeLodGrid(&lod_cells, &lod_grids[i]);
+
+			for (int i = 0; i < chunk_count && impostor_count < lod_cells.count; ++i) {
+				int room = update_jobs[i].end - update_jobs[i].begin - chunk_visible[i];
+				int packed = lod_cells.count - impostor_count < room ? lod_cells.count - impostor_count : room;
+				int slot = chunk_first[i] + chunk_visible[i];
+				packImpostors(&lod_cells, impostor_count, impostor_count + packed, premultiplied,
+					options.position_format, frames[0].bounds, (char*)instances.positions + slot * stride,
+					(uint32_t*)(instances.statics + slot));
+				chunk_visible[i] += packed;
+				impostor_count += packed;
+			}
+		}
 
-		// Calculate camera up
-		glm_vec3_copy(GLM_YUP, camera_up);
-		glm_vec3_rotate(camera_up, -pitch, camera_right);
+		// Sorted back to front over all systems, and copied to the mapped
+		// buffers in that order. Culled particles sort last and are left out.
+		int sorted_count = 0;
+		if (sorting && instances.positions != NULL) {
+			for (int s = 0; s < system_count; ++s) {
+				sort_first[s] = systems[s].base;
+				sort_count[s] = systems[s].particles->count;
+			}
+			uint64_t sort_start = SDL_GetPerformanceCounter();
+			sortDepth(&depth_sort, pool, sort_first, sort_count, system_count);
+			double sort_ms = (double)((SDL_GetPerformanceCounter() - sort_start)*1000) 
+				/ SDL_GetPerformanceFrequency();
+			stats_sort_ms += sort_ms;
+			run_sort_ms += sort_ms;
+			stats_sorted += depth_sort.count;
+			run_sorted += depth_sort.count;
+
+			for (int i = 0; i < chunk_count; ++i)
+				sorted_count += chunk_visible[i];
+			if (sorted_count > depth_sort.count)
+				sorted_count = depth_sort.count;
+
+			struct SortGather gather = {&depth_sort, instances.positions, (uint32_t*)instances.statics};
+			parallelFor(pool, 0, sorted_count, PARTICLE_ALIGN, gather_range, &gather);
+		}
 
-		glm_look(camera_pos, camera_dir, GLM_YUP, view);
-		uniform3f(program, "cameraUp_worldspace", camera_up);
-		uniform3f(program, "cameraRight_worldspace", camera_right);
-		glm_mat4_mul(proj, view, vp);
-		uniformMatrix4fv(program, "VP", vp);
+		if (options.backend == BACKEND_FEEDBACK) {
+			stepFeedbackSim(&feedback, steps, step_accel, step_dt);
+			particle_count = feedback.count;
+		} else if (options.backend == BACKEND_COMPUTE) {
+			stepComputeSim(&compute, steps, step_accel, step_dt);
+			particle_count = compute.count;
+		} else {
+			// Every system is one range of the arena, or when compacting
+			// every chunk, and the count is what is drawn. Sorted, they are
+			// one.
+			struct DrawRanges* ranges = &draw_ranges[instances.region];
+			if (sorting) {
+				reserve_ranges(ranges, 1);
+				ranges->first[0] = 0;
+				ranges->count[0] = sorted_count;
+				particle_count = sorted_count;
+			} else if (compact) {
+				reserve_ranges(ranges, chunk_count);
+				particle_count = 0;
+				for (int i = 0; i < chunk_count; ++i) {
+					ranges->first[i] = chunk_first[i];
+					ranges->count[i] = chunk_visible[i];
+					particle_count += chunk_visible[i];
+				}
+			} else {
+				reserve_ranges(ranges, system_count);
+				for (int s = 0; s < system_count; ++s) {
+					ranges->first[s] = systems[s].base;
+					ranges->count[s] = systems[s].particles->count;
+				}
+			}
+			if (endInstanceUpload(&instances) == 0)
+				particle_count = 0;
+		}
+
+		if (options.renderer == RENDER_PULL) {
+			int position_base, position_texels;
+			instanceTextureLayout(&instances, &position_base, &position_texels);
+			uniform1i(render_program, "positionBase", position_base);
+			uniform1i(render_program, "positionTexels", position_texels);
+			if (!bindInstanceTextures(&instances, pull_position_unit, pull_static_unit)) {
+				fprintf(stderr, "Too many particles for texture buffers, drawing with attributes\n");
+				options.renderer = RENDER_ATTRIBUTES;
+				draw_program = program;
+			}
+		}
+
+		uniform3f(draw_program, "cameraUp_worldspace", camera_up);
+		uniform3f(draw_program, "cameraRight_worldspace", camera_right);
+		uniformMatrix4fv(draw_program, "VP", vp);
+		int box_region = instances.draw_region >= 0 ? instances.draw_region : instances.region;
+		uniform3f(draw_program, "positionOrigin", region_origins[box_region]);
+		uniform3f(draw_program, "positionExtent", region_extents[box_region]);
+		uniform1f(draw_program, "velocityBlend", on_gpu ? -(1.0f - sim_alpha) * step_dt : 0.0f);
+		uniform1f(draw_program, "pointScale", proj[1][1] * window_height * 0.5f);
 
 		// RENDERING
 		// ---------
-		glUseProgram(program);
+		glUseProgram(draw_program);
 
 		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 		glClear(GL_COLOR_BUFFER_BIT);
+		if (options.blend == BLEND_OIT)
+			beginOitTarget(&oit);
 
 		glBindTexture(GL_TEXTURE_2D, tex);
-		
-		// First argument specifies index of vertex attrib and second argument 
-		// specifies how the buffer advances for every instance
-		// Docs: https://docs.gl/gl3/glVertexAttribDivisor
-		glVertexAttribDivisor(0, 0);
-		glVertexAttribDivisor(1, 1);
-		glVertexAttribDivisor(2, 1);
 
-		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, particle_count);
+		if (options.backend == BACKEND_FEEDBACK) {
+			drawFeedbackSim(&feedback);
+		} else if (options.backend == BACKEND_COMPUTE) {
+			drawComputeSim(&compute);
+		} else {
+			struct DrawRanges* ranges = &draw_ranges[instances.draw_region];
+
+			if (particle_count == 0) {
+				// Nothing to draw
+			} else if (options.renderer == RENDER_PULL) {
+				// gl_InstanceID does not count the base instance, so 
+				// pulling takes a draw per system
+				glBindVertexArray(pull_vao);
+				for (int i = 0; i < ranges->ranges; ++i) {
+					glUniform1i(instance_base_location, ranges->first[i]);
+					glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, ranges->count[i]);
+				}
+				glBindVertexArray(vao);
+			} else if (options.renderer == RENDER_POINTS || options.renderer == RENDER_GEOMETRY) {
+				drawInstanceRanges(&instances, GL_POINTS, 1, ranges->first, ranges->count, ranges->ranges);
+			} else {
+				drawInstanceRanges(&instances, GL_TRIANGLE_STRIP, 4, ranges->first, ranges->count, ranges->ranges);
+			}
+			fenceInstanceUpload(&instances);
+		}
+
+		if (options.blend == BLEND_OIT) {
+			compositeOitTarget(&oit);
+			glBindVertexArray(vao);
+		}
 
 		SDL_GL_SwapWindow(window);
 
@@ -437,22 +1038,255 @@ int main(int argc, char* argv[]) {
 			now_t = SDL_GetPerformanceCounter();
 			delta_t = (double)((now_t - last_t)*1000) / SDL_GetPerformanceFrequency(); // in ms
 		}
+
+		stats_ms += delta_t;
+		run_ms += delta_t;
+		run_vertices += (double)particle_count * particle_vertices;
+		stats_fence_ms += instances.fence_wait_ms;
+		++stats_frames;
+		if (stats_ms >= 1000.0) {
+			char title[192];
+			int length = snprintf(title, sizeof(title), "Particles - %d particles, %.2f ms/frame, %.3f ms fence wait",
+				particle_count, stats_ms / stats_frames, stats_fence_ms / stats_frames);
+			if (stats_sorted > 0.0) {
+				length += snprintf(title + length, sizeof(title) - length, ", sort %.2f ms/M", 
+					stats_sort_ms / stats_sorted * 1e6);
+			}
+			if (options.lod > 0.0f && length < (int)sizeof(title))
+				snprintf(title + length, sizeof(title) - length, ", %d impostors", impostor_count);
+			SDL_SetWindowTitle(window, title);
+			stats_ms = stats_fence_ms = 0.0;
+			stats_sort_ms = stats_sorted = 0.0;
+			stats_frames = 0;
+
+			// Particles that pass close to the origin turn small differences
+			// into big ones over time, so every check starts over from the 
+			// CPU and covers a second of steps
+			if (on_gpu && options.verify) {
+				float error = verify_gpu(&options, &feedback, &compute, systems[0].particles);
+				printf("GPU off from CPU by %g\n", error);
+				if (!(error <= verify_error))
+					verify_error = error;
+			}
+			if (!on_gpu && options.verify) {
+				float error = verify_simd(systems, system_count, step_accel);
+				printf("SIMD off from scalar by %g\n", error);
+				if (!(error <= simd_error))
+					simd_error = error;
+			}
+		}
+
+		if (options.frames > 0 && ++frame_number >= options.frames)
+			running = false;
+	}
+
+	if (options.frames > 0)
+		printf("%d frames, %.3f ms/frame, %.1f M vertices/s\n", frame_number, 
+			run_ms / frame_number, run_vertices / run_ms / 1000.0);
+	if (options.frames > 0 && run_sorted > 0.0)
+		printf("Sorting took %.3f ms per million particles\n", run_sort_ms / run_sorted * 1e6);
+
+	// Once more at the end, short runs may not have checked at all
+	if (on_gpu && options.verify) {
+		float error = verify_gpu(&options, &feedback, &compute, systems[0].particles);
+		if (!(error <= verify_error))
+			verify_error = error;
+		printf("GPU off from CPU by at most %g\n", verify_error);
+	}
+	if (!on_gpu && options.verify) {
+		float error = verify_simd(systems, system_count, particle_accel*sim_step);
+		if (!(error <= simd_error))
+			simd_error = error;
+		printf("SIMD off from scalar by at most %g\n", simd_error);
 	}
 
 	// DESTRUCTION
 	// ===========
-	free(particle_container);
-	free(g_particle_color_data);
-	free(g_particle_position_size_data);
+	destroyThreadPool(pool); // Finishes any chunk jobs still queued
+	free(init_jobs);
+	free(inits);
+	for (int s = 0; s < system_count; ++s)
+		destroyParticleSystem(systems[s].particles);
+	free(systems);
+	free(frames);
+	free(sort_first);
+	free(sort_count);
+	free(frame_chunks.jobs);
+	free(frame_chunks.bounds);
+	free(frame_chunks.first);
+	free(frame_chunks.visible);
+	for (int i = 0; i < INSTANCE_MAX_REGIONS; ++i) {
+		free(draw_ranges[i].first);
+		free(draw_ranges[i].count);
+	}
+	destroyInstanceBuffers(&instances);
+	if (options.sort)
+		destroyDepthSort(&depth_sort);
+	if (options.blend == BLEND_OIT)
+		destroyOitTarget(&oit);
+	for (int i = 0; i < lod_grid_count; ++i)
+		destroyLodGrid(&lod_grids[i]);
+	free(lod_grids);
+	destroyLodGrid(&lod_cells);
+	glDeleteProgram(render_program);
+	glDeleteVertexArrays(1, &pull_vao);
+	if (options.backend == BACKEND_FEEDBACK)
+		destroyFeedbackSim(&feedback);
+	else if (options.backend == BACKEND_COMPUTE)
+		destroyComputeSim(&compute);
 
 	SDL_DestroyWindow(window);
 	SDL_Quit();
 
-	return 0;
+	return verify_error <= PARTICLE_GPU_TOLERANCE && simd_error <= PARTICLE_SIMD_TOLERANCE ? 0 : 1;
+}
+
+void update_range(void* data, int begin, int end) {
+	/* Runs the steps for one chunk, the last one packs the positions.
+	 * Compacting packs after the steps instead, and sorting packs every
+	 * particle to its slot in the sort's arrays.
+	 */
+	struct FrameUpdate* frame = data;
+	bool compact = frame->cull != NULL && frame->keys == NULL;
+
+	for (int i = 0; i < frame->steps; ++i) {
+		bool last = i == frame->steps - 1;
+		struct ParticleStep step = {
+			.accel = frame->accel,
+			.dt = frame->dt,
+			.keep_previous = last,
+			.alpha = frame->alpha,
+			.format = frame->format,
+			.positions = last && frame->format != POSITION_UNORM16 && !compact 
+				? frame->positions : NULL,
+		};
+		updateParticles(frame->particles, begin, end, &step);
+	}
+
+	if (frame->keys != NULL) {
+		frame->chunk_visible[begin / frame->chunk] = depthKeys(frame->particles, begin, end, 
+			frame->alpha, frame->depth, frame->cull, frame->keys);
+	}
+
+	if (frame->format == POSITION_UNORM16) {
+		float* bounds = frame->chunk_bounds[begin / frame->chunk];
+		for (int k = 0; k < 3; ++k) {
+			bounds[k] = FLT_MAX;
+			bounds[3 + k] = -FLT_MAX;
+		}
+		particleBounds(frame->particles, begin, end, bounds);
+	} else if (compact && frame->positions != NULL) {
+		frame->chunk_visible[begin / frame->chunk] = pack_visible(frame, begin, end);
+	} else if (frame->steps == 0 && frame->positions != NULL) {
+		packPositions(frame->particles, begin, end, frame->alpha, frame->format, frame->positions);
+	}
+}
+
+void quantize_range(void* data, int begin, int end) {
+	struct FrameUpdate* frame = data;
+	if (frame->cull != NULL && frame->keys == NULL) {
+		frame->chunk_visible[begin / frame->chunk] = pack_visible(frame, begin, end);
+	} else {
+		packPositionsUnorm16(frame->particles, begin, end, frame->alpha, frame->bounds, frame->positions);
+	}
+}
+
+int pack_visible(struct FrameUpdate* frame, int begin, int end) {
+	/* Packs the visible particles of a chunk to its front, or with --lod
+	 * only the near ones and the far ones to the chunk's grid.
+	 */
+	if (frame->lod == NULL) {
+		return packVisible(frame->particles, begin, end, frame->cull, 
+			frame->positions, frame->statics);
+	}
+
+	struct LodGrid* grid = &frame->lod_grids[begin / frame->chunk];
+	clearLodGrid(grid, frame->lod->cell);
+	return packNear(frame->particles, begin, end, frame->cull, frame->lod, grid, 
+		frame->positions, frame->statics);
 }
 
-float rand_float() {
-	return (float)rand()/(float)RAND_MAX;
+void reserve_ranges(struct DrawRanges* draw, int ranges) {
+	/* Makes room for ranges ranges and sets the count to it.
+	 */
+	if (ranges > draw->capacity) {
+		draw->capacity = ranges * 2;
+		draw->first = realloc(draw->first, sizeof(int) * draw->capacity);
+		draw->count = realloc(draw->count, sizeof(int) * draw->capacity);
+	}
+	draw->ranges = ranges;
+}
+
+void reserve_chunks(struct FrameChunks* chunks, int count) {
+	/* Makes room for count chunks, at least one.
+	 */
+	if (count >= chunks->capacity) {
+		chunks->capacity = count * 2 + 1;
+		chunks->jobs = realloc(chunks->jobs, sizeof(struct Job) * chunks->capacity);
+		chunks->bounds = realloc(chunks->bounds, sizeof(float[6]) * chunks->capacity);
+		chunks->first = realloc(chunks->first, sizeof(int) * chunks->capacity);
+		chunks->visible = realloc(chunks->visible, sizeof(int) * chunks->capacity);
+	}
+}
+
+void gather_range(void* data, int begin, int end) {
+	struct SortGather* gather = data;
+	gatherSorted(gather->sort, begin, end, gather->positions, gather->statics);
+}
+
+void init_range(void* data, int begin, int end) {
+	struct ParticleInit* init = data;
+	initParticles(init->particles, init->emitter, init->seed, begin, end, 0);
+}
+
+float verify_gpu(const struct Options* options, struct FeedbackSim* feedback, 
+		struct ComputeSim* compute, struct ParticleSystem* particles) {
+	/* Compares the GPU backend in use with the CPU steps and starts it over
+	 * from the CPU particles, returns the positionError.
+	 */
+	float error = 0.0f;
+	if (options->backend == BACKEND_FEEDBACK) {
+		error = compareFeedbackSim(feedback, particles);
+		uploadFeedbackSim(feedback, particles, 0, particles->count);
+	} else if (options->backend == BACKEND_COMPUTE) {
+		error = compareComputeSim(compute, particles);
+		uploadComputeSim(compute, particles, 0, particles->count);
+	}
+	return error;
+}
+
+float verify_simd(const struct System* systems, int system_count, float accel) {
+	/* Steps the first particles of every system with the SIMD kernels and 
+	 * the scalar ones, returns the worst simdError.
+	 */
+	float error = 0.0f;
+	for (int s = 0; s < system_count; ++s) {
+		const struct ParticleSystem* ps = systems[s].particles;
+		int count = ps->count < verify_simd_particles ? ps->count : verify_simd_particles;
+		float system_error = simdError(ps, count, accel);
+		if (!(system_error <= error))
+			error = system_error;
+	}
+	return error;
+}
+
+void load_image(void* data, int begin, int end) {
+	struct ImageLoad* image = data;
+	image->pixels = stbi_load(image->path, &image->width, &image->height, &image->comp, 0);
+	if (image->pixels == NULL) {
+		fprintf(stderr, "Could not load %s\n", image->path);
+		return;
+	}
+
+	// Rounded, so full alpha keeps the color as it is
+	if (image->premultiply && image->comp == 4) {
+		unsigned char* p = image->pixels;
+		for (size_t i = 0; i < (size_t)image->width * image->height; ++i, p += 4) {
+			p[0] = (p[0] * p[3] + 127) / 255;
+			p[1] = (p[1] * p[3] + 127) / 255;
+			p[2] = (p[2] * p[3] + 127) / 255;
+		}
+	}
 }
 
 // I could expand this
@@ -0,0 +1,108 @@
+/* The render targets and the composite of weighted blended OIT. Core 3.3 has
+ * no glBlendFunci, so both targets add colors and multiply alphas, which puts
+ * the revealage in accum's alpha. weight only uses its red channel.
+ */
+#include <stdio.h>
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+#include "oit.h"
+#include "shader.h"
+
+// Texture units the composite reads the targets from
+#define OIT_ACCUM_UNIT 3
+#define OIT_WEIGHT_UNIT 4
+
+static void allocateTargets(struct OitTarget* oit, int width, int height) {
+	oit->width = width > 0 ? width : 1;
+	oit->height = height > 0 ? height : 1;
+
+	glBindTexture(GL_TEXTURE_2D, oit->accum_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, oit->width, oit->height, 0, GL_RGBA, GL_HALF_FLOAT, NULL);
+	glBindTexture(GL_TEXTURE_2D, oit->weight_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, oit->width, oit->height, 0, GL_RED, GL_HALF_FLOAT, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+bool createOitTarget(struct OitTarget* oit, int width, int height) {
+	/* Creates the targets at the size of the window and the composite
+	 * program. Returns false if the framebuffer is not complete, half float
+	 * render targets are core 3.0 so that should not happen.
+	 */
+	glGenTextures(1, &oit->accum_texture);
+	glGenTextures(1, &oit->weight_texture);
+	uint32_t textures[2] = {oit->accum_texture, oit->weight_texture};
+	for (int i = 0; i < 2; ++i) {
+		glBindTexture(GL_TEXTURE_2D, textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+	allocateTargets(oit, width, height);
+
+	glGenFramebuffers(1, &oit->framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, oit->framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, oit->accum_texture, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, oit->weight_texture, 0);
+	const GLenum draw_buffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+	glDrawBuffers(2, draw_buffers);
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	oit->composite_program = createProgramVF("res/fullscreen_vert.glsl", "res/oit_composite_frag.glsl");
+	uniform1i(oit->composite_program, "accumTexture", OIT_ACCUM_UNIT);
+	uniform1i(oit->composite_program, "weightTexture", OIT_WEIGHT_UNIT);
+	glGenVertexArrays(1, &oit->vao);
+
+	if (!complete) {
+		fprintf(stderr, "The OIT framebuffer is not complete\n");
+		destroyOitTarget(oit);
+		return false;
+	}
+	return true;
+}
+
+void destroyOitTarget(struct OitTarget* oit) {
+	glDeleteFramebuffers(1, &oit->framebuffer);
+	glDeleteTextures(1, &oit->accum_texture);
+	glDeleteTextures(1, &oit->weight_texture);
+	glDeleteProgram(oit->composite_program);
+	glDeleteVertexArrays(1, &oit->vao);
+}
+
+void resizeOitTarget(struct OitTarget* oit, int width, int height) {
+	if (width != oit->width || height != oit->height)
+		allocateTargets(oit, width, height);
+}
+
+void beginOitTarget(struct OitTarget* oit) {
+	/* Binds and clears the targets for the particles to be drawn into. 
+	 * Revealage starts at 1, nothing covers the background yet.
+	 */
+	const float accum_clear[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+	const float weight_clear[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+	glBindFramebuffer(GL_FRAMEBUFFER, oit->framebuffer);
+	glClearBufferfv(GL_COLOR, 0, accum_clear);
+	glClearBufferfv(GL_COLOR, 1, weight_clear);
+	glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+void compositeOitTarget(struct OitTarget* oit) {
+	/* Blends the targets over the window's framebuffer and leaves the blend
+	 * function as it was before beginOitTarget. Binds a vertex array of its
+	 * own and texture unit 0.
+	 */
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	glActiveTexture(GL_TEXTURE0 + OIT_ACCUM_UNIT);
+	glBindTexture(GL_TEXTURE_2D, oit->accum_texture);
+	glActiveTexture(GL_TEXTURE0 + OIT_WEIGHT_UNIT);
+	glBindTexture(GL_TEXTURE_2D, oit->weight_texture);
+	glActiveTexture(GL_TEXTURE0);
+
+	glUseProgram(oit->composite_program);
+	glBindVertexArray(oit->vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
@@ -0,0 +1,26 @@
+#ifndef OIT_H
+#define OIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Weighted blended order-independent transparency (McGuire and Bavoil, JCGT
+ * 2013). accum and weight sum weighted colors and alphas in any order, and
+ * the composite blends their average over the screen.
+ */
+struct OitTarget {
+	uint32_t framebuffer;
+	uint32_t accum_texture;  // RGBA16F
+	uint32_t weight_texture; // R16F
+	uint32_t composite_program;
+	uint32_t vao; // Empty, the composite makes its triangle from gl_VertexID
+	int width, height;
+};
+
+bool createOitTarget(struct OitTarget* oit, int width, int height);
+void destroyOitTarget(struct OitTarget* oit);
+void resizeOitTarget(struct OitTarget* oit, int width, int height);
+void beginOitTarget(struct OitTarget* oit);
+void compositeOitTarget(struct OitTarget* oit);
+
+#endif
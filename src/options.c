@@ -0,0 +1,302 @@
+/* Command line and config file parsing. A config file has one "name value"
+ * per line, the long name without dashes, and # starts a comment. Options
+ * apply in order, so what comes after --config wins over the file.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+
+static void printUsage(const char* program) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -t, --threads N    Worker threads for the update, 0 for one per core\n"
+		"  -r, --sim-rate HZ  Simulation steps per second (default 60)\n"
+		"  -e, --emit-rate N  Particles spawned per second (default 0)\n"
+		"  -l, --lifetime MS  How long particles live, 0 for forever (default)\n"
+		"  -s, --seed N       Seed for a reproducible run (default from the clock)\n"
+		"  -n, --particles N  Particles at startup (default 50000)\n"
+		"  -c, --capacity N   Room for particles at startup, grows when needed\n"
+		"  -u, --upload MODE  Instance upload, map (default), persistent or on a\n"
+		"                     thread of its own\n"
+		"  -p, --positions F  Position format, float (default), half or unorm16\n"
+		"  -b, --backend B    Simulate on the cpu (default), or on the GPU with\n"
+		"                     feedback (GL 3.3) or compute (GL 4.3)\n"
+		"  -w, --workgroup N  Compute shader workgroup size (default 256)\n"
+		"  -R, --render R     How to draw: attributes (default) or pull for quads,\n"
+		"                     points for sprites, geometry to expand points\n"
+		"  -S, --systems N    Split the particles between N emitters (default 1)\n"
+		"  -d, --separate-draws  Draw every system on its own, not all at once\n"
+		"  -C, --cull         Only upload and draw the particles in view\n"
+		"  -z, --sort         Draw back to front, sorted by depth every frame\n"
+		"  -B, --blend MODE   alpha (default), oit for order-independent weighted\n"
+		"                     blending, additive or premultiplied alpha\n"
+		"  -L, --lod DIST     Draw particles farther than DIST as one impostor per\n"
+		"                     cell of a grid, 0 for never (default)\n"
+		"  -v, --verify       Check the GPU backend or the SIMD steps against the\n"
+		"                     scalar CPU ones, exits with 1 if off\n"
+		"  -F, --frames N     Quit after N frames, 0 runs until closed (default)\n"
+		"  -f, --config FILE  Read options from FILE\n"
+		"  -h, --help         Show this text\n",
+		program
+	);
+}
+
+static bool parseInt(const char* text, int min, int* value) {
+	char* end;
+	errno = 0;
+	long parsed = strtol(text, &end, 10);
+	if (end == text || *end != '\0' || errno == ERANGE || parsed < min || parsed > INT_MAX)
+		return false;
+	*value = (int)parsed;
+	return true;
+}
+
+static bool parseFloat(const char* text, float min, float* value) {
+	char* end;
+	float parsed = strtof(text, &end);
+	if (end == text || *end != '\0' || !(parsed >= min))
+		return false;
+	*value = parsed;
+	return true;
+}
+
+static bool parseUint64(const char* text, uint64_t* value) {
+	char* end;
+	unsigned long long parsed = strtoull(text, &end, 10);
+	if (end == text || *end != '\0' || text[0] == '-')
+		return false;
+	*value = (uint64_t)parsed;
+	return true;
+}
+
+static bool is(const char* arg, const char* short_name, const char* long_name) {
+	return strcmp(arg, short_name) == 0 || strcmp(arg, long_name) == 0;
+}
+
+static bool readConfig(struct Options* options, const char* path);
+
+static int applyOption(struct Options* options, const char* arg, const char* value) {
+	/* Applies one option. Returns how many values it used, or -1 if the
+	 * program should not start.
+	 */
+	if (is(arg, "-h", "--help")) {
+		return -1;
+	} else if (is(arg, "-t", "--threads")) {
+		if (value == NULL || !parseInt(value, 0, &options->threads)) {
+			fprintf(stderr, "%s needs a thread count\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-r", "--sim-rate")) {
+		if (value == NULL || !parseInt(value, 1, &options->sim_rate)) {
+			fprintf(stderr, "%s needs a rate in Hz\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-e", "--emit-rate")) {
+		if (value == NULL || !parseInt(value, 0, &options->emit_rate)) {
+			fprintf(stderr, "%s needs a particle count\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-l", "--lifetime")) {
+		if (value == NULL || !parseInt(value, 0, &options->lifetime)) {
+			fprintf(stderr, "%s needs a time in ms\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-s", "--seed")) {
+		if (value == NULL || !parseUint64(value, &options->seed)) {
+			fprintf(stderr, "%s needs a number\n", arg);
+			return -1;
+		}
+		options->has_seed = true;
+	} else if (is(arg, "-n", "--particles")) {
+		if (value == NULL || !parseInt(value, 0, &options->particles)) {
+			fprintf(stderr, "%s needs a particle count\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-c", "--capacity")) {
+		if (value == NULL || !parseInt(value, 1, &options->capacity)) {
+			fprintf(stderr, "%s needs a particle count\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-u", "--upload")) {
+		if (value != NULL && strcmp(value, "map") == 0) {
+			options->upload = UPLOAD_MAP;
+		} else if (value != NULL && strcmp(value, "persistent") == 0) {
+			options->upload = UPLOAD_PERSISTENT;
+		} else if (value != NULL && strcmp(value, "thread") == 0) {
+			options->upload = UPLOAD_THREAD;
+		} else {
+			fprintf(stderr, "%s needs map, persistent or thread\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-p", "--positions")) {
+		if (value != NULL && strcmp(value, "float") == 0) {
+			options->position_format = POSITION_FLOAT;
+		} else if (value != NULL && strcmp(value, "half") == 0) {
+			options->position_format = POSITION_HALF;
+		} else if (value != NULL && strcmp(value, "unorm16") == 0) {
+			options->position_format = POSITION_UNORM16;
+		} else {
+			fprintf(stderr, "%s needs float, half or unorm16\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-b", "--backend")) {
+		if (value != NULL && strcmp(value, "cpu") == 0) {
+			options->backend = BACKEND_CPU;
+		} else if (value != NULL && strcmp(value, "feedback") == 0) {
+			options->backend = BACKEND_FEEDBACK;
+		} else if (value != NULL && strcmp(value, "compute") == 0) {
+			options->backend = BACKEND_COMPUTE;
+		} else {
+			fprintf(stderr, "%s needs cpu, feedback or compute\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-w", "--workgroup")) {
+		if (value == NULL || !parseInt(value, 1, &options->workgroup)) {
+			fprintf(stderr, "%s needs an invocation count\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-R", "--render")) {
+		if (value != NULL && strcmp(value, "attributes") == 0) {
+			options->renderer = RENDER_ATTRIBUTES;
+		} else if (value != NULL && strcmp(value, "pull") == 0) {
+			options->renderer = RENDER_PULL;
+		} else if (value != NULL && strcmp(value, "points") == 0) {
+			options->renderer = RENDER_POINTS;
+		} else if (value != NULL && strcmp(value, "geometry") == 0) {
+			options->renderer = RENDER_GEOMETRY;
+		} else {
+			fprintf(stderr, "%s needs attributes, pull, points or geometry\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-S", "--systems")) {
+		if (value == NULL || !parseInt(value, 1, &options->systems)) {
+			fprintf(stderr, "%s needs a system count\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-d", "--separate-draws")) {
+		options->separate_draws = true;
+		return 0;
+	} else if (is(arg, "-C", "--cull")) {
+		options->cull = true;
+		return 0;
+	} else if (is(arg, "-z", "--sort")) {
+		options->sort = true;
+		return 0;
+	} else if (is(arg, "-B", "--blend")) {
+		if (value != NULL && strcmp(value, "alpha") == 0) {
+			options->blend = BLEND_ALPHA;
+		} else if (value != NULL && strcmp(value, "oit") == 0) {
+			options->blend = BLEND_OIT;
+		} else if (value != NULL && strcmp(value, "additive") == 0) {
+			options->blend = BLEND_ADDITIVE;
+		} else if (value != NULL && strcmp(value, "premultiplied") == 0) {
+			options->blend = BLEND_PREMULTIPLIED;
+		} else {
+			fprintf(stderr, "%s needs alpha, oit, additive or premultiplied\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-L", "--lod")) {
+		if (value == NULL || !parseFloat(value, 0.0f, &options->lod)) {
+			fprintf(stderr, "%s needs a distance\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-v", "--verify")) {
+		options->verify = true;
+		return 0;
+	} else if (is(arg, "-F", "--frames")) {
+		if (value == NULL || !parseInt(value, 0, &options->frames)) {
+			fprintf(stderr, "%s needs a frame count\n", arg);
+			return -1;
+		}
+	} else if (is(arg, "-f", "--config")) {
+		if (value == NULL || !readConfig(options, value))
+			return -1;
+	} else {
+		fprintf(stderr, "Unknown option %s\n", arg);
+		return -1;
+	}
+
+	return 1;
+}
+
+static bool readConfig(struct Options* options, const char* path) {
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open config %s\n", path);
+		return false;
+	}
+
+	char line[256];
+	int line_number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), fp) != NULL) {
+		++line_number;
+
+		// Split into "--name" and value, '=' counts as whitespace
+		char arg[64] = "--";
+		char value[192];
+		for (char* c = line; *c; ++c)
+			if (*c == '=')
+				*c = ' ';
+		int fields = sscanf(line, "%61s %191s", arg + 2, value);
+		if (fields <= 0 || arg[2] == '#')
+			continue;
+
+		// Configs do not nest, so none can end up reading itself
+		bool nested = is(arg, "-f", "--config");
+		if (nested)
+			fprintf(stderr, "%s can not be used in a config\n", arg);
+		if (nested || applyOption(options, arg, fields == 2 ? value : NULL) < 0) {
+			fprintf(stderr, "In %s on line %d\n", path, line_number);
+			ok = false;
+		}
+	}
+
+	fclose(fp);
+	return ok;
+}
+
+bool parseOptions(struct Options* options, int argc, char* argv[]) {
+	/* Fills options from argv. Prints the usage and returns false if the
+	 * program should not start.
+	 */
+	options->threads = 0;
+	options->sim_rate = 60;
+	options->emit_rate = 0;
+	options->lifetime = 0;
+	options->has_seed = false;
+	options->seed = 0;
+	options->particles = 50000;
+	options->capacity = 0;
+	options->upload = UPLOAD_MAP;
+	options->position_format = POSITION_FLOAT;
+	options->backend = BACKEND_CPU;
+	options->workgroup = 256;
+	options->renderer = RENDER_ATTRIBUTES;
+	options->systems = 1;
+	options->separate_draws = false;
+	options->cull = false;
+	options->sort = false;
+	options->blend = BLEND_ALPHA;
+	options->lod = 0.0f;
+	options->verify = false;
+	options->frames = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		int used = applyOption(options, argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+		if (used < 0) {
+			printUsage(argv[0]);
+			return false;
+		}
+		i += used;
+	}
+
+	if (options->capacity < options->particles)
+		options->capacity = options->particles;
+
+	return true;
+}
@@ -0,0 +1,60 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "particles.h"
+#include "instances.h"
+
+// Where the simulation runs
+enum Backend {
+	BACKEND_CPU,
+	BACKEND_FEEDBACK, // Transform feedback on the GPU
+	BACKEND_COMPUTE, // Compute shaders, GL 4.3
+};
+
+// How the CPU backend's particles are drawn
+enum Renderer {
+	RENDER_ATTRIBUTES, // Instanced vertex attributes
+	RENDER_PULL, // Fetched from texture buffers by the vertex shader
+	RENDER_POINTS, // GL_POINTS sprites, one vertex per particle
+	RENDER_GEOMETRY, // Points expanded to quads in a geometry shader
+};
+
+// How overlapping particles are blended
+enum Blend {
+	BLEND_ALPHA, // Over what is behind, only right back to front
+	BLEND_OIT, // Weighted blended order-independent transparency
+	BLEND_ADDITIVE, // Adds up, for emissive particles, in any order
+	BLEND_PREMULTIPLIED, // Over what is behind with premultiplied colors
+};
+
+// Everything that can be set from the command line
+struct Options {
+	int threads; // 0 means one per core
+	int sim_rate; // Simulation steps per second
+	int emit_rate; // Particles spawned per second
+	int lifetime; // In ms, 0 lives forever
+	bool has_seed;
+	uint64_t seed; // For the random numbers, from the clock if not set
+	int particles; // At startup
+	int capacity; // Room at startup, at least particles
+	enum UploadMode upload; // Of the instance positions
+	enum PositionFormat position_format; // Of the streamed positions
+	enum Backend backend;
+	int workgroup; // Invocations per compute workgroup
+	enum Renderer renderer;
+	int systems; // Particle systems, each with its own emitter
+	bool separate_draws; // A draw call per system instead of one for all
+	bool cull; // Only pack and draw the particles in view
+	bool sort; // Draw back to front
+	enum Blend blend;
+	float lod; // Distance past which particles become impostors, 0 for never
+	bool verify; // Check the GPU backend or SIMD steps against the CPU
+	int frames; // Quit after this many, 0 runs until closed
+};
+
+bool parseOptions(struct Options* options, int argc, char* argv[]);
+
+#endif
@@ -0,0 +1,1017 @@
+/* The particle store and the passes that run over it. Keep the loops in here
+ * free from OpenGL so they can run on any thread.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#include "particles.h"
+#include "lod.h"
+
+#define CACHE_LINE 64
+
+static size_t alignUp(size_t value, size_t alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static bool allocateArrays(struct ParticleSystem* ps, int capacity) {
+	/* Points the arrays of ps at a new block with room for at least capacity
+	 * particles. All arrays live in one block of memory, each one starting
+	 * on its own cache line. Leaves ps untouched if the allocation fails.
+	 */
+	capacity = (int)alignUp(capacity > 0 ? capacity : 1, PARTICLE_ALIGN);
+	size_t array_size = alignUp(sizeof(float) * capacity, CACHE_LINE);
+
+	// 12 arrays plus slack to align the start of the block
+	char* block = malloc(12 * array_size + CACHE_LINE);
+	if (block == NULL)
+		return false;
+	char* base = (char*)alignUp((size_t)block, CACHE_LINE);
+
+	ps->capacity = capacity;
+	ps->x      = (float*)(base + 0 * array_size);
+	ps->y      = (float*)(base + 1 * array_size);
+	ps->z      = (float*)(base + 2 * array_size);
+	ps->prev_x = (float*)(base + 3 * array_size);
+	ps->prev_y = (float*)(base + 4 * array_size);
+	ps->prev_z = (float*)(base + 5 * array_size);
+	ps->vx     = (float*)(base + 6 * array_size);
+	ps->vy     = (float*)(base + 7 * array_size);
+	ps->vz     = (float*)(base + 8 * array_size);
+	ps->size   = (float*)(base + 9 * array_size);
+	ps->color  = (uint32_t*)(base + 10 * array_size);
+	ps->expires = (int32_t*)(base + 11 * array_size);
+
+	// Remember the real start of the block so it can be freed
+	ps->block = block;
+
+	return true;
+}
+
+static uint16_t floatToHalf(float value) {
+	/* IEEE half with round to nearest even, the same as F16C gives. From
+	 * https://gist.github.com/rygorous/2156668 (float_to_half_fast3_rtne).
+	 */
+	const uint32_t f32_infinity = 255u << 23;
+	const uint32_t f16_max = (127u + 16) << 23;
+	const uint32_t denormal_magic = ((127u - 15) + (23 - 10) + 1) << 23;
+
+	uint32_t f;
+	memcpy(&f, &value, sizeof(f));
+	uint32_t sign = f & 0x80000000u;
+	f ^= sign;
+
+	uint16_t half;
+	if (f >= f16_max) {
+		half = f > f32_infinity ? 0x7e00 : 0x7c00; // NaN or infinity
+	} else if (f < (113u << 23)) {
+		// Too small for a normal half, let float addition do the rounding
+		float shifted, magic;
+		memcpy(&shifted, &f, sizeof(f));
+		memcpy(&magic, &denormal_magic, sizeof(magic));
+		shifted += magic;
+		memcpy(&f, &shifted, sizeof(f));
+		half = (uint16_t)(f - denormal_magic);
+	} else {
+		uint32_t odd = (f >> 13) & 1;
+		f += ((uint32_t)(15 - 127) << 23) + 0xfff;
+		f += odd;
+		half = (uint16_t)(f >> 13);
+	}
+	return half | (uint16_t)(sign >> 16);
+}
+
+int positionStride(enum PositionFormat format) {
+	return format == POSITION_FLOAT ? 3 * sizeof(float) : 4 * sizeof(uint16_t);
+}
+
+struct ParticleSystem* createParticleSystem(int capacity) {
+	/* Allocates a particle system with room for at least capacity particles.
+	 * Returns NULL if the allocation fails.
+	 */
+	struct ParticleSystem* ps = malloc(sizeof(struct ParticleSystem));
+	if (ps == NULL)
+		return NULL;
+
+	ps->count = 0;
+	clearParticlesDirty(ps);
+	if (!allocateArrays(ps, capacity)) {
+		free(ps);
+		return NULL;
+	}
+
+	return ps;
+}
+
+bool reserveParticles(struct ParticleSystem* ps, int capacity) {
+	/* Makes room for at least capacity particles, at least doubling. No job
+	 * may use ps meanwhile. Returns false if the memory could not be
+	 * allocated, ps is then left as it was.
+	 */
+	if (capacity <= ps->capacity)
+		return true;
+	if (capacity < 2 * ps->capacity)
+		capacity = 2 * ps->capacity;
+
+	struct ParticleSystem old = *ps;
+	if (!allocateArrays(ps, capacity))
+		return false;
+
+	size_t floats = sizeof(float) * ps->count;
+	memcpy(ps->x, old.x, floats);
+	memcpy(ps->y, old.y, floats);
+	memcpy(ps->z, old.z, floats);
+	memcpy(ps->prev_x, old.prev_x, floats);
+	memcpy(ps->prev_y, old.prev_y, floats);
+	memcpy(ps->prev_z, old.prev_z, floats);
+	memcpy(ps->vx, old.vx, floats);
+	memcpy(ps->vy, old.vy, floats);
+	memcpy(ps->vz, old.vz, floats);
+	memcpy(ps->size, old.size, floats);
+	memcpy(ps->color, old.color, sizeof(uint32_t) * ps->count);
+	memcpy(ps->expires, old.expires, sizeof(int32_t) * ps->count);
+
+	free(old.block);
+	return true;
+}
+
+void markParticlesDirty(struct ParticleSystem* ps, int begin, int end) {
+	/* Adds the slots [begin, end) to the ones whose size and color have to
+	 * be uploaded again. Only one span is kept, so two far apart slots also
+	 * mark everything in between.
+	 */
+	if (begin >= end)
+		return;
+	if (ps->dirty_begin >= ps->dirty_end) {
+		ps->dirty_begin = begin;
+		ps->dirty_end = end;
+		return;
+	}
+	if (begin < ps->dirty_begin)
+		ps->dirty_begin = begin;
+	if (end > ps->dirty_end)
+		ps->dirty_end = end;
+}
+
+void clearParticlesDirty(struct ParticleSystem* ps) {
+	ps->dirty_begin = 0;
+	ps->dirty_end = 0;
+}
+
+void destroyParticleSystem(struct ParticleSystem* ps) {
+	if (ps == NULL)
+		return;
+	free(ps->block);
+	free(ps);
+}
+
+int addParticle(struct ParticleSystem* ps, vec3 pos, vec3 speed, float size, uint32_t color, int32_t expires) {
+	/* Takes the first free slot for a particle and returns its index, or -1
+	 * if the system is full. It dies at simulation step expires.
+	 */
+	if (ps->count >= ps->capacity)
+		return -1;
+
+	int i = ps->count++;
+	ps->x[i] = ps->prev_x[i] = pos[0];
+	ps->y[i] = ps->prev_y[i] = pos[1];
+	ps->z[i] = ps->prev_z[i] = pos[2];
+	ps->vx[i] = speed[0];
+	ps->vy[i] = speed[1];
+	ps->vz[i] = speed[2];
+	ps->size[i] = size;
+	ps->color[i] = color;
+	ps->expires[i] = expires;
+	markParticlesDirty(ps, i, i + 1);
+
+	return i;
+}
+
+static void moveParticle(struct ParticleSystem* ps, int from, int to) {
+	ps->x[to] = ps->x[from];
+	ps->y[to] = ps->y[from];
+	ps->z[to] = ps->z[from];
+	ps->prev_x[to] = ps->prev_x[from];
+	ps->prev_y[to] = ps->prev_y[from];
+	ps->prev_z[to] = ps->prev_z[from];
+	ps->vx[to] = ps->vx[from];
+	ps->vy[to] = ps->vy[from];
+	ps->vz[to] = ps->vz[from];
+	ps->size[to] = ps->size[from];
+	ps->color[to] = ps->color[from];
+	ps->expires[to] = ps->expires[from];
+}
+
+int removeDeadParticles(struct ParticleSystem* ps, int32_t now) {
+	/* Frees every particle that expires at or before step now by moving the
+	 * last live particle into its slot. Returns how many were removed.
+	 */
+	int count = ps->count;
+	for (int i = 0; i < count; ) {
+		if (ps->expires[i] <= now) {
+			--count;
+			if (i != count) {
+				moveParticle(ps, count, i);
+				markParticlesDirty(ps, i, i + 1);
+			}
+			// The particle moved into i has not been checked yet
+		} else {
+			++i;
+		}
+	}
+
+	int removed = ps->count - count;
+	ps->count = count;
+	return removed;
+}
+
+static void fillParticles(struct ParticleSystem* ps, const struct Emitter* emitter, 
+		struct RandomLanes* random, int begin, int end, int32_t now, bool spread_lifetime) {
+	/* Writes new particles from emitter into the slots [begin, end).
+	 *
+	 * With spread_lifetime every particle gets a random share of the 
+	 * lifetime, so a first population does not all die on the same step.
+	 */
+	// Random numbers are made a batch at a time, 7 per particle
+	enum { BATCH = 256 };
+	float r[7 * BATCH];
+
+	for (int first = begin; first < end; first += BATCH) {
+		int n = end - first < BATCH ? end - first : BATCH;
+		randomFloats(random, r, 7 * n);
+
+		for (int i = 0; i < n; ++i) {
+			const float* ri = r + 7 * i;
+			int p = first + i;
+
+			ps->x[p] = ps->prev_x[p] = emitter->pos[0] + (ri[0]-0.5f)*emitter->spread;
+			ps->y[p] = ps->prev_y[p] = emitter->pos[1] + (ri[1]-0.5f)*emitter->spread;
+			ps->z[p] = ps->prev_z[p] = emitter->pos[2] + (ri[2]-0.5f)*emitter->spread;
+			ps->vx[p] = (ri[3]-0.5f)*emitter->speed;
+			ps->vy[p] = (ri[4]-0.5f)*emitter->speed;
+			ps->vz[p] = (ri[5]-0.5f)*emitter->speed;
+			ps->size[p] = emitter->size;
+			ps->color[p] = emitter->color;
+
+			ps->expires[p] = PARTICLE_FOREVER;
+			if (emitter->lifetime > 0) {
+				float share = spread_lifetime ? ri[6] : 1.0f;
+				ps->expires[p] = now + 1 + (int32_t)(share * (emitter->lifetime - 1));
+			}
+		}
+	}
+}
+
+int spawnParticles(struct ParticleSystem* ps, struct Emitter* emitter, int count, int32_t now, bool spread_lifetime) {
+	/* Spawns count particles from emitter, growing ps if it is full. Returns
+	 * how many were spawned, which is less than count only if ps could not
+	 * grow.
+	 */
+	reserveParticles(ps, ps->count + count);
+
+	int free_slots = ps->capacity - ps->count;
+	if (count > free_slots)
+		count = free_slots; // What does not fit is dropped
+
+	fillParticles(ps, emitter, &emitter->random, ps->count, ps->count + count, now, spread_lifetime);
+	markParticlesDirty(ps, ps->count, ps->count + count);
+	ps->count += count;
+
+	return count;
+}
+
+void initParticles(struct ParticleSystem* ps, const struct Emitter* emitter, uint64_t seed, int begin, int end, int32_t now) {
+	/* Fills the slots [begin, end) from emitter without touching count, the
+	 * dirty span or the emitter, so ranges can be filled in parallel. The
+	 * stream depends only on seed and begin, whichever thread runs it.
+	 */
+	struct RandomLanes random;
+	seedRandomLanes(&random, seed, 1 + (uint64_t)begin); // The emitter has 0
+
+	fillParticles(ps, emitter, &random, begin, end, now, true);
+}
+
+int emitParticles(struct ParticleSystem* ps, struct Emitter* emitter, double ms, int32_t now) {
+	/* Spawns the particles emitter makes in ms of simulated time. Returns 
+	 * how many were spawned.
+	 */
+	emitter->pending += emitter->rate * ms / 1000.0;
+	int spawn = (int)emitter->pending;
+	emitter->pending -= spawn;
+
+	return spawnParticles(ps, emitter, spawn, now, false);
+}
+
+void updateParticlesScalar(struct ParticleSystem* ps, int begin, int end, const struct ParticleStep* step) {
+	/* Accelerates particles [begin, end) towards the origin and moves them.
+	 *
+	 * This is the reference the SIMD kernels are measured against.
+	 */
+	float* restrict x = ps->x;
+	float* restrict y = ps->y;
+	float* restrict z = ps->z;
+	float* restrict vx = ps->vx;
+	float* restrict vy = ps->vy;
+	float* restrict vz = ps->vz;
+	float* restrict positions = step->format == POSITION_FLOAT ? step->positions : NULL;
+	uint16_t* restrict halves = step->format == POSITION_HALF ? step->positions : NULL;
+	const float accel = step->accel;
+	const float dt = step->dt;
+	const float alpha = step->alpha;
+
+	for (int i = begin; i < end; ++i) {
+		if (step->keep_previous) {
+			ps->prev_x[i] = x[i];
+			ps->prev_y[i] = y[i];
+			ps->prev_z[i] = z[i];
+		}
+
+		float dx = -x[i];
+		float dy = -y[i];
+		float dz = -z[i];
+
+		// Same as glm_vec3_normalize, a zero vector stays zero
+		float len = sqrtf(dx*dx + dy*dy + dz*dz);
+		float k = len < FLT_EPSILON ? 0.0f : accel / len;
+
+		vx[i] += dx * k;
+		vy[i] += dy * k;
+		vz[i] += dz * k;
+
+		// The interpolated position is old + v * dt * alpha
+		if (positions != NULL) {
+			positions[3*i+0] = x[i] + vx[i] * dt * alpha;
+			positions[3*i+1] = y[i] + vy[i] * dt * alpha;
+			positions[3*i+2] = z[i] + vz[i] * dt * alpha;
+		}
+		if (halves != NULL) {
+			halves[4*i+0] = floatToHalf(x[i] + vx[i] * dt * alpha);
+			halves[4*i+1] = floatToHalf(y[i] + vy[i] * dt * alpha);
+			halves[4*i+2] = floatToHalf(z[i] + vz[i] * dt * alpha);
+			halves[4*i+3] = 0;
+		}
+
+		x[i] += vx[i] * dt;
+		y[i] += vy[i] * dt;
+		z[i] += vz[i] * dt;
+	}
+}
+
+void packPositions(struct ParticleSystem* ps, int begin, int end, float alpha, enum PositionFormat format, void* positions) {
+	/* Writes the positions of particles [begin, end), alpha of the way from
+	 * the previous step, in format (POSITION_FLOAT or POSITION_HALF). For
+	 * frames without a step, the last step packs them itself.
+	 */
+	float* floats = positions;
+	uint16_t* halves = positions;
+
+	for (int i = begin; i < end; ++i) {
+		float x = ps->prev_x[i] + (ps->x[i] - ps->prev_x[i]) * alpha;
+		float y = ps->prev_y[i] + (ps->y[i] - ps->prev_y[i]) * alpha;
+		float z = ps->prev_z[i] + (ps->z[i] - ps->prev_z[i]) * alpha;
+		if (format == POSITION_HALF) {
+			halves[4*i+0] = floatToHalf(x);
+			halves[4*i+1] = floatToHalf(y);
+			halves[4*i+2] = floatToHalf(z);
+			halves[4*i+3] = 0;
+		} else {
+			floats[3*i+0] = x;
+			floats[3*i+1] = y;
+			floats[3*i+2] = z;
+		}
+	}
+}
+
+float positionError(const struct ParticleSystem* ps, const float* positions, int stride, int count) {
+	/* Returns the largest distance between the first count particles of ps 
+	 * and positions, x y z every stride floats, relative to how far out the
+	 * particle is (at least 1). NaN counts as infinitely far.
+	 */
+	float worst = 0.0f;
+	for (int i = 0; i < count; ++i, positions += stride) {
+		float dx = positions[0] - ps->x[i];
+		float dy = positions[1] - ps->y[i];
+		float dz = positions[2] - ps->z[i];
+		float len = sqrtf(ps->x[i]*ps->x[i] + ps->y[i]*ps->y[i] + ps->z[i]*ps->z[i]);
+		float error = sqrtf(dx*dx + dy*dy + dz*dz) / (len > 1.0f ? len : 1.0f);
+		if (!(error <= worst))
+			worst = error;
+	}
+	return worst != worst ? INFINITY : worst;
+}
+
+float simdError(const struct ParticleSystem* ps, int count, float accel) {
+	/* Steps copies of the first count particles of ps with updateParticles
+	 * and updateParticlesScalar and returns the largest difference of their
+	 * velocity changes, relative to accel. 0 if the copies do not fit.
+	 */
+	struct ParticleSystem* copies[2] = {createParticleSystem(count), createParticleSystem(count)};
+	float worst = 0.0f;
+	if (copies[0] != NULL && copies[1] != NULL && accel > 0.0f) {
+		// From standing, the velocities are the changes without rounding
+		for (int c = 0; c < 2; ++c) {
+			copies[c]->count = count;
+			memcpy(copies[c]->x, ps->x, sizeof(float) * count);
+			memcpy(copies[c]->y, ps->y, sizeof(float) * count);
+			memcpy(copies[c]->z, ps->z, sizeof(float) * count);
+			memset(copies[c]->vx, 0, sizeof(float) * count);
+			memset(copies[c]->vy, 0, sizeof(float) * count);
+			memset(copies[c]->vz, 0, sizeof(float) * count);
+		}
+
+		struct ParticleStep step = { .accel = accel, .dt = 0.0f };
+		updateParticles(copies[0], 0, count, &step);
+		updateParticlesScalar(copies[1], 0, count, &step);
+
+		for (int i = 0; i < count; ++i) {
+			float dx = copies[0]->vx[i] - copies[1]->vx[i];
+			float dy = copies[0]->vy[i] - copies[1]->vy[i];
+			float dz = copies[0]->vz[i] - copies[1]->vz[i];
+			float error = sqrtf(dx*dx + dy*dy + dz*dz) / accel;
+			if (!(error <= worst))
+				worst = error;
+		}
+	}
+
+	for (int c = 0; c < 2; ++c)
+		destroyParticleSystem(copies[c]);
+	return worst != worst ? INFINITY : worst;
+}
+
+void particleBounds(struct ParticleSystem* ps, int begin, int end, float bounds[6]) {
+	/* Grows bounds (min x, y, z then max x, y, z) to hold particles [begin,
+	 * end) at both their previous and current position. Every position in
+	 * between is inside then too, whatever alpha the frame is drawn at.
+	 */
+	const float* arrays[6] = {ps->x, ps->y, ps->z, ps->prev_x, ps->prev_y, ps->prev_z};
+
+	for (int a = 0; a < 6; ++a) {
+		const float* values = arrays[a];
+		float low = bounds[a % 3];
+		float high = bounds[3 + a % 3];
+		for (int i = begin; i < end; ++i) {
+			low = values[i] < low ? values[i] : low;
+			high = values[i] > high ? values[i] : high;
+		}
+		bounds[a % 3] = low;
+		bounds[3 + a % 3] = high;
+	}
+}
+
+static void unorm16Box(const float bounds[6], float origin[3], float scale[3]) {
+	for (int k = 0; k < 3; ++k) {
+		float extent = bounds[3 + k] - bounds[k];
+		origin[k] = bounds[k];
+		scale[k] = extent > FLT_EPSILON ? 65535.0f / extent : 0.0f;
+	}
+}
+
+static inline void storeUnorm16(uint16_t* out, const float p[3], const float origin[3], const float scale[3]) {
+	for (int k = 0; k < 3; ++k) {
+		float q = (p[k] - origin[k]) * scale[k] + 0.5f;
+		q = q < 0.0f ? 0.0f : (q > 65535.0f ? 65535.0f : q);
+		out[k] = (uint16_t)q;
+	}
+	out[3] = 0;
+}
+
+void packPositionsUnorm16(struct ParticleSystem* ps, int begin, int end, float alpha, const float bounds[6], uint16_t* positions) {
+	/* Same as packPositions, but as 16 bit fractions of the box bounds from
+	 * particleBounds. The vertex shader scales them back with the box.
+	 */
+	float origin[3], scale[3];
+	unorm16Box(bounds, origin, scale);
+
+	for (int i = begin; i < end; ++i) {
+		float p[3] = {
+			ps->prev_x[i] + (ps->x[i] - ps->prev_x[i]) * alpha,
+			ps->prev_y[i] + (ps->y[i] - ps->prev_y[i]) * alpha,
+			ps->prev_z[i] + (ps->z[i] - ps->prev_z[i]) * alpha,
+		};
+		storeUnorm16(positions + 4*i, p, origin, scale);
+	}
+}
+
+#if defined(__SSE__)
+static inline void storeXYZ4(float* out, __m128 x, __m128 y, __m128 z) {
+	/* Interleaves 4 particles into 12 floats: x0 y0 z0 x1 | y1 z1 x2 y2 |
+	 * z2 x3 y3 z3. Unaligned, since out moves 3 floats per particle.
+	 */
+	__m128 t0 = _mm_unpacklo_ps(x, y); // x0 y0 x1 y1
+	__m128 t1 = _mm_unpackhi_ps(x, y); // x2 y2 x3 y3
+	__m128 u = _mm_shuffle_ps(z, t0, _MM_SHUFFLE(2, 2, 0, 0)); // z0 z0 x1 x1
+	__m128 v = _mm_shuffle_ps(t0, z, _MM_SHUFFLE(1, 1, 3, 3)); // y1 y1 z1 z1
+	__m128 w = _mm_shuffle_ps(z, t1, _MM_SHUFFLE(3, 2, 3, 2)); // z2 z3 x3 y3
+
+	_mm_storeu_ps(out + 0, _mm_shuffle_ps(t0, u, _MM_SHUFFLE(2, 0, 1, 0)));
+	_mm_storeu_ps(out + 4, _mm_shuffle_ps(v, t1, _MM_SHUFFLE(1, 0, 2, 0)));
+	_mm_storeu_ps(out + 8, _mm_shuffle_ps(w, w, _MM_SHUFFLE(1, 3, 2, 0)));
+}
+#endif
+
+#if defined(__AVX__)
+static inline void storeXYZ8(float* out, __m256 x, __m256 y, __m256 z) {
+	/* storeXYZ4 on both 128 bit lanes, then the lanes are put in order.
+	 */
+	__m256 t0 = _mm256_unpacklo_ps(x, y);
+	__m256 t1 = _mm256_unpackhi_ps(x, y);
+	__m256 u = _mm256_shuffle_ps(z, t0, _MM_SHUFFLE(2, 2, 0, 0));
+	__m256 v = _mm256_shuffle_ps(t0, z, _MM_SHUFFLE(1, 1, 3, 3));
+	__m256 w = _mm256_shuffle_ps(z, t1, _MM_SHUFFLE(3, 2, 3, 2));
+
+	__m256 o0 = _mm256_shuffle_ps(t0, u, _MM_SHUFFLE(2, 0, 1, 0));
+	__m256 o1 = _mm256_shuffle_ps(v, t1, _MM_SHUFFLE(1, 0, 2, 0));
+	__m256 o2 = _mm256_shuffle_ps(w, w, _MM_SHUFFLE(1, 3, 2, 0));
+
+	// The low lanes hold particles 0-3, the high lanes 4-7
+	_mm256_storeu_ps(out + 0,  _mm256_permute2f128_ps(o0, o1, 0x20));
+	_mm256_storeu_ps(out + 8,  _mm256_permute2f128_ps(o2, o0, 0x30));
+	_mm256_storeu_ps(out + 16, _mm256_permute2f128_ps(o1, o2, 0x31));
+}
+#endif
+
+#if defined(__SSE__)
+static inline void storeHalf4(uint16_t* out, __m128 x, __m128 y, __m128 z) {
+	/* 4 particles as x y z 0 halves, 32 bytes.
+	 */
+#if defined(__F16C__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i hx = _mm_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT);
+	__m128i hy = _mm_cvtps_ph(y, _MM_FROUND_TO_NEAREST_INT);
+	__m128i hz = _mm_cvtps_ph(z, _MM_FROUND_TO_NEAREST_INT);
+	__m128i xy = _mm_unpacklo_epi16(hx, hy); // x0 y0 x1 y1 x2 y2 x3 y3
+	__m128i z0 = _mm_unpacklo_epi16(hz, zero); // z0 0 z1 0 z2 0 z3 0
+
+	_mm_storeu_si128((__m128i*)(out + 0), _mm_unpacklo_epi32(xy, z0));
+	_mm_storeu_si128((__m128i*)(out + 8), _mm_unpackhi_epi32(xy, z0));
+#else
+	float xyz[12];
+	storeXYZ4(xyz, x, y, z);
+	for (int i = 0; i < 4; ++i) {
+		out[4*i+0] = floatToHalf(xyz[3*i+0]);
+		out[4*i+1] = floatToHalf(xyz[3*i+1]);
+		out[4*i+2] = floatToHalf(xyz[3*i+2]);
+		out[4*i+3] = 0;
+	}
+#endif
+}
+#endif
+
+#if defined(__AVX__)
+static inline void storeHalf8(uint16_t* out, __m256 x, __m256 y, __m256 z) {
+#if defined(__F16C__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i hx = _mm256_cvtps_ph(x, _MM_FROUND_TO_NEAREST_INT);
+	__m128i hy = _mm256_cvtps_ph(y, _MM_FROUND_TO_NEAREST_INT);
+	__m128i hz = _mm256_cvtps_ph(z, _MM_FROUND_TO_NEAREST_INT);
+	__m128i xy_low = _mm_unpacklo_epi16(hx, hy);
+	__m128i xy_high = _mm_unpackhi_epi16(hx, hy);
+	__m128i z0_low = _mm_unpacklo_epi16(hz, zero);
+	__m128i z0_high = _mm_unpackhi_epi16(hz, zero);
+
+	_mm_storeu_si128((__m128i*)(out + 0),  _mm_unpacklo_epi32(xy_low, z0_low));
+	_mm_storeu_si128((__m128i*)(out + 8),  _mm_unpackhi_epi32(xy_low, z0_low));
+	_mm_storeu_si128((__m128i*)(out + 16), _mm_unpacklo_epi32(xy_high, z0_high));
+	_mm_storeu_si128((__m128i*)(out + 24), _mm_unpackhi_epi32(xy_high, z0_high));
+#else
+	storeHalf4(out, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), 
+		_mm256_castps256_ps128(z));
+	storeHalf4(out + 16, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), 
+		_mm256_extractf128_ps(z, 1));
+#endif
+}
+#endif
+
+#if defined(__AVX__)
+static int updateParticlesAVX(struct ParticleSystem* ps, int begin, int end, const struct ParticleStep* step) {
+	/* 8 particles per iteration, rsqrt plus one Newton-Raphson step. Returns
+	 * the index of the first particle it did not update.
+	 */
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 three_halves = _mm256_set1_ps(1.5f);
+	const __m256 min_len2 = _mm256_set1_ps(FLT_EPSILON * FLT_EPSILON);
+	const __m256 va = _mm256_set1_ps(step->accel);
+	const __m256 vdt = _mm256_set1_ps(step->dt);
+	const __m256 vdt_alpha = _mm256_set1_ps(step->dt * step->alpha);
+	float* positions = step->format == POSITION_FLOAT ? step->positions : NULL;
+	uint16_t* halves = step->format == POSITION_HALF ? step->positions : NULL;
+
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 px = _mm256_loadu_ps(ps->x + i);
+		__m256 py = _mm256_loadu_ps(ps->y + i);
+		__m256 pz = _mm256_loadu_ps(ps->z + i);
+		if (step->keep_previous) {
+			_mm256_storeu_ps(ps->prev_x + i, px);
+			_mm256_storeu_ps(ps->prev_y + i, py);
+			_mm256_storeu_ps(ps->prev_z + i, pz);
+		}
+
+		__m256 len2 = _mm256_add_ps(
+			_mm256_mul_ps(px, px), 
+			_mm256_add_ps(_mm256_mul_ps(py, py), _mm256_mul_ps(pz, pz))
+		);
+		__m256 r = _mm256_rsqrt_ps(len2); // 12 bits, r * (1.5 - 0.5 * len2 * r * r) refines it
+		__m256 rr = _mm256_mul_ps(_mm256_mul_ps(half, len2), _mm256_mul_ps(r, r));
+		r = _mm256_mul_ps(r, _mm256_sub_ps(three_halves, rr));
+
+		// Zero length gives inf * 0 = NaN, mask those out
+		__m256 k = _mm256_and_ps(
+			_mm256_mul_ps(va, r), 
+			_mm256_cmp_ps(len2, min_len2, _CMP_GE_OQ)
+		);
+
+		// The direction is -pos, so subtract instead of negating
+		__m256 vx = _mm256_sub_ps(_mm256_loadu_ps(ps->vx + i), _mm256_mul_ps(px, k));
+		__m256 vy = _mm256_sub_ps(_mm256_loadu_ps(ps->vy + i), _mm256_mul_ps(py, k));
+		__m256 vz = _mm256_sub_ps(_mm256_loadu_ps(ps->vz + i), _mm256_mul_ps(pz, k));
+
+		_mm256_storeu_ps(ps->vx + i, vx);
+		_mm256_storeu_ps(ps->vy + i, vy);
+		_mm256_storeu_ps(ps->vz + i, vz);
+		_mm256_storeu_ps(ps->x + i, _mm256_add_ps(px, _mm256_mul_ps(vx, vdt)));
+		_mm256_storeu_ps(ps->y + i, _mm256_add_ps(py, _mm256_mul_ps(vy, vdt)));
+		_mm256_storeu_ps(ps->z + i, _mm256_add_ps(pz, _mm256_mul_ps(vz, vdt)));
+
+		if (positions != NULL) {
+			storeXYZ8(positions + 3*i,
+				_mm256_add_ps(px, _mm256_mul_ps(vx, vdt_alpha)),
+				_mm256_add_ps(py, _mm256_mul_ps(vy, vdt_alpha)),
+				_mm256_add_ps(pz, _mm256_mul_ps(vz, vdt_alpha)));
+		}
+		if (halves != NULL) {
+			storeHalf8(halves + 4*i,
+				_mm256_add_ps(px, _mm256_mul_ps(vx, vdt_alpha)),
+				_mm256_add_ps(py, _mm256_mul_ps(vy, vdt_alpha)),
+				_mm256_add_ps(pz, _mm256_mul_ps(vz, vdt_alpha)));
+		}
+	}
+	return i;
+}
+#endif
+
+#if defined(__SSE__)
+static int updateParticlesSSE(struct ParticleSystem* ps, int begin, int end, const struct ParticleStep* step) {
+	/* Same as updateParticlesAVX but 4 particles per iteration.
+	 */
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 three_halves = _mm_set1_ps(1.5f);
+	const __m128 min_len2 = _mm_set1_ps(FLT_EPSILON * FLT_EPSILON);
+	const __m128 va = _mm_set1_ps(step->accel);
+	const __m128 vdt = _mm_set1_ps(step->dt);
+	const __m128 vdt_alpha = _mm_set1_ps(step->dt * step->alpha);
+	float* positions = step->format == POSITION_FLOAT ? step->positions : NULL;
+	uint16_t* halves = step->format == POSITION_HALF ? step->positions : NULL;
+
+	int i = begin;
+	for (; i + 4 <= end; i += 4) {
+		__m128 px = _mm_loadu_ps(ps->x + i);
+		__m128 py = _mm_loadu_ps(ps->y + i);
+		__m128 pz = _mm_loadu_ps(ps->z + i);
+		if (step->keep_previous) {
+			_mm_storeu_ps(ps->prev_x + i, px);
+			_mm_storeu_ps(ps->prev_y + i, py);
+			_mm_storeu_ps(ps->prev_z + i, pz);
+		}
+
+		__m128 len2 = _mm_add_ps(
+			_mm_mul_ps(px, px), 
+			_mm_add_ps(_mm_mul_ps(py, py), _mm_mul_ps(pz, pz))
+		);
+		__m128 r = _mm_rsqrt_ps(len2);
+		__m128 rr = _mm_mul_ps(_mm_mul_ps(half, len2), _mm_mul_ps(r, r));
+		r = _mm_mul_ps(r, _mm_sub_ps(three_halves, rr));
+
+		__m128 k = _mm_and_ps(_mm_mul_ps(va, r), _mm_cmpge_ps(len2, min_len2));
+
+		__m128 vx = _mm_sub_ps(_mm_loadu_ps(ps->vx + i), _mm_mul_ps(px, k));
+		__m128 vy = _mm_sub_ps(_mm_loadu_ps(ps->vy + i), _mm_mul_ps(py, k));
+		__m128 vz = _mm_sub_ps(_mm_loadu_ps(ps->vz + i), _mm_mul_ps(pz, k));
+
+		_mm_storeu_ps(ps->vx + i, vx);
+		_mm_storeu_ps(ps->vy + i, vy);
+		_mm_storeu_ps(ps->vz + i, vz);
+		_mm_storeu_ps(ps->x + i, _mm_add_ps(px, _mm_mul_ps(vx, vdt)));
+		_mm_storeu_ps(ps->y + i, _mm_add_ps(py, _mm_mul_ps(vy, vdt)));
+		_mm_storeu_ps(ps->z + i, _mm_add_ps(pz, _mm_mul_ps(vz, vdt)));
+
+		if (positions != NULL) {
+			storeXYZ4(positions + 3*i,
+				_mm_add_ps(px, _mm_mul_ps(vx, vdt_alpha)),
+				_mm_add_ps(py, _mm_mul_ps(vy, vdt_alpha)),
+				_mm_add_ps(pz, _mm_mul_ps(vz, vdt_alpha)));
+		}
+		if (halves != NULL) {
+			storeHalf4(halves + 4*i,
+				_mm_add_ps(px, _mm_mul_ps(vx, vdt_alpha)),
+				_mm_add_ps(py, _mm_mul_ps(vy, vdt_alpha)),
+				_mm_add_ps(pz, _mm_mul_ps(vz, vdt_alpha)));
+		}
+	}
+	return i;
+}
+#endif
+
+void updateParticles(struct ParticleSystem* ps, int begin, int end, const struct ParticleStep* step) {
+	/* Same as updateParticlesScalar, but runs the widest kernel the compiler
+	 * was allowed to use (see ARCH in the Makefile) and finishes the tail 
+	 * with the scalar loop.
+	 */
+#if defined(__AVX__)
+	begin = updateParticlesAVX(ps, begin, end, step);
+#elif defined(__SSE__)
+	begin = updateParticlesSSE(ps, begin, end, step);
+#endif
+	updateParticlesScalar(ps, begin, end, step);
+}
+
+static inline bool insideFrustum(const struct ParticleCull* cull, const float p[3], float radius) {
+	// Written so that NaN is outside, like the _CMP_GE_OQ in packVisibleAVX
+	for (int k = 0; k < 6; ++k) {
+		const float* plane = cull->planes[k];
+		float d = plane[0] * p[0] + plane[1] * p[1] + plane[2] * p[2] + plane[3];
+		if (!(d + radius >= 0.0f))
+			return false;
+	}
+	return true;
+}
+
+static inline void storeVisible(struct ParticleSystem* ps, int i, const float p[3], const struct ParticleCull* cull, 
+		const float origin[3], const float scale[3], void* positions, uint32_t* statics, int out) {
+	/* Writes particle i, at p, to slot out.
+	 */
+	if (cull->format == POSITION_FLOAT) {
+		float* floats = positions;
+		floats[3*out+0] = p[0];
+		floats[3*out+1] = p[1];
+		floats[3*out+2] = p[2];
+	} else if (cull->format == POSITION_HALF) {
+		uint16_t* halves = positions;
+		halves[4*out+0] = floatToHalf(p[0]);
+		halves[4*out+1] = floatToHalf(p[1]);
+		halves[4*out+2] = floatToHalf(p[2]);
+		halves[4*out+3] = 0;
+	} else {
+		storeUnorm16((uint16_t*)positions + 4*out, p, origin, scale);
+	}
+	memcpy(statics + 2*out, ps->size + i, sizeof(float));
+	statics[2*out+1] = ps->color[i];
+}
+
+#if defined(__AVX__)
+static int packVisibleAVX(struct ParticleSystem* ps, int begin, int end, const struct ParticleCull* cull, 
+		void* positions, uint32_t* statics, int* out) {
+	/* Tests 8 particles against all planes at once and stores them whole if
+	 * all are visible, POSITION_FLOAT and POSITION_HALF only. Returns the
+	 * index of the first particle it did not look at.
+	 */
+	const __m256 alpha = _mm256_set1_ps(cull->alpha);
+	const __m256 radius_scale = _mm256_set1_ps(PARTICLE_CULL_RADIUS);
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 planes[6][4];
+	for (int k = 0; k < 6; ++k)
+		for (int c = 0; c < 4; ++c)
+			planes[k][c] = _mm256_set1_ps(cull->planes[k][c]);
+
+	int n = *out;
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 ox = _mm256_loadu_ps(ps->prev_x + i);
+		__m256 oy = _mm256_loadu_ps(ps->prev_y + i);
+		__m256 oz = _mm256_loadu_ps(ps->prev_z + i);
+		__m256 px = _mm256_add_ps(ox, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ps->x + i), ox), alpha));
+		__m256 py = _mm256_add_ps(oy, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ps->y + i), oy), alpha));
+		__m256 pz = _mm256_add_ps(oz, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ps->z + i), oz), alpha));
+		__m256 size = _mm256_loadu_ps(ps->size + i);
+		__m256 radius = _mm256_mul_ps(size, radius_scale);
+
+		__m256 inside = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ); // All ones
+		for (int k = 0; k < 6; ++k) {
+			__m256 d = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(planes[k][0], px), _mm256_mul_ps(planes[k][1], py)),
+				_mm256_add_ps(_mm256_mul_ps(planes[k][2], pz), planes[k][3])
+			);
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(d, radius), zero, _CMP_GE_OQ));
+		}
+
+		int mask = _mm256_movemask_ps(inside);
+		if (mask == 0xFF) {
+			if (cull->format == POSITION_HALF)
+				storeHalf8((uint16_t*)positions + 4*n, px, py, pz);
+			else
+				storeXYZ8((float*)positions + 3*n, px, py, pz);
+
+			// size and color interleaved, 0 1 4 5 and 2 3 6 7 before the permute
+			__m256 color = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)(ps->color + i)));
+			__m256 low = _mm256_unpacklo_ps(size, color);
+			__m256 high = _mm256_unpackhi_ps(size, color);
+			_mm256_storeu_ps((float*)(statics + 2*n), _mm256_permute2f128_ps(low, high, 0x20));
+			_mm256_storeu_ps((float*)(statics + 2*n + 8), _mm256_permute2f128_ps(low, high, 0x31));
+			n += 8;
+		} else if (mask != 0) {
+			float lx[8], ly[8], lz[8];
+			_mm256_storeu_ps(lx, px);
+			_mm256_storeu_ps(ly, py);
+			_mm256_storeu_ps(lz, pz);
+			for (int lane = 0; lane < 8; ++lane) {
+				if (mask & 1 << lane) {
+					float p[3] = {lx[lane], ly[lane], lz[lane]};
+					storeVisible(ps, i + lane, p, cull, NULL, NULL, positions, statics, n++);
+				}
+			}
+		}
+	}
+	*out = n;
+	return i;
+}
+#endif
+
+int packVisible(struct ParticleSystem* ps, int begin, int end, const struct ParticleCull* cull, void* positions, uint32_t* statics) {
+	/* Packs the particles of [begin, end) inside the frustum to slots begin,
+	 * begin + 1, ... of positions, with size and color in the same slots of
+	 * statics (struct StaticInstance). Returns how many were visible.
+	 */
+	int first = begin;
+	int out = begin;
+	float origin[3], scale[3];
+	if (cull->format == POSITION_UNORM16) {
+		unorm16Box(cull->bounds, origin, scale);
+	} else {
+#if defined(__AVX__)
+		begin = packVisibleAVX(ps, begin, end, cull, positions, statics, &out);
+#endif
+	}
+
+	for (int i = begin; i < end; ++i) {
+		float p[3] = {
+			ps->prev_x[i] + (ps->x[i] - ps->prev_x[i]) * cull->alpha,
+			ps->prev_y[i] + (ps->y[i] - ps->prev_y[i]) * cull->alpha,
+			ps->prev_z[i] + (ps->z[i] - ps->prev_z[i]) * cull->alpha,
+		};
+		if (insideFrustum(cull, p, ps->size[i] * PARTICLE_CULL_RADIUS))
+			storeVisible(ps, i, p, cull, origin, scale, positions, statics, out++);
+	}
+	return out - first;
+}
+
+int packNear(struct ParticleSystem* ps, int begin, int end, const struct ParticleCull* cull, const struct ParticleLod* lod,
+		struct LodGrid* grid, void* positions, uint32_t* statics) {
+	/* packVisible for the particles within lod->distance of the camera, the
+	 * visible ones farther away go to grid. Returns how many were packed.
+	 */
+	int out = begin;
+	float origin[3], scale[3];
+	if (cull->format == POSITION_UNORM16)
+		unorm16Box(cull->bounds, origin, scale);
+	float near = lod->distance * lod->distance;
+
+	for (int i = begin; i < end; ++i) {
+		float p[3] = {
+			ps->prev_x[i] + (ps->x[i] - ps->prev_x[i]) * cull->alpha,
+			ps->prev_y[i] + (ps->y[i] - ps->prev_y[i]) * cull->alpha,
+			ps->prev_z[i] + (ps->z[i] - ps->prev_z[i]) * cull->alpha,
+		};
+		if (!insideFrustum(cull, p, ps->size[i] * PARTICLE_CULL_RADIUS))
+			continue;
+
+		float dx = p[0] - lod->camera[0];
+		float dy = p[1] - lod->camera[1];
+		float dz = p[2] - lod->camera[2];
+		if (dx*dx + dy*dy + dz*dz < near)
+			storeVisible(ps, i, p, cull, origin, scale, positions, statics, out++);
+		else
+			addLodParticle(grid, p, ps->size[i], ps->color[i]);
+	}
+	return out - begin;
+}
+
+void packPoint(const float p[3], enum PositionFormat format, const float bounds[6], void* positions, int slot) {
+	/* Writes one position to slot of positions in format, bounds is only
+	 * read for POSITION_UNORM16. For what is not a particle, like impostors.
+	 */
+	if (format == POSITION_FLOAT) {
+		float* floats = positions;
+		floats[3*slot+0] = p[0];
+		floats[3*slot+1] = p[1];
+		floats[3*slot+2] = p[2];
+	} else if (format == POSITION_HALF) {
+		uint16_t* halves = positions;
+		halves[4*slot+0] = floatToHalf(p[0]);
+		halves[4*slot+1] = floatToHalf(p[1]);
+		halves[4*slot+2] = floatToHalf(p[2]);
+		halves[4*slot+3] = 0;
+	} else {
+		float origin[3], scale[3];
+		unorm16Box(bounds, origin, scale);
+		storeUnorm16((uint16_t*)positions + 4*slot, p, origin, scale);
+	}
+}
+
+static inline uint32_t depthKey(float value) {
+	/* Flips the bits of a float so that comparing them as unsigned ints 
+	 * orders them like the floats: negatives are flipped whole, positives
+	 * get the sign bit. Then the top PARTICLE_DEPTH_BITS are kept.
+	 */
+	value += 0.0f; // -0 would flip to the farthest key
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	bits = value < 0.0f ? ~bits : bits ^ 0x80000000u;
+	return bits >> (32 - PARTICLE_DEPTH_BITS);
+}
+
+#if defined(__AVX__)
+static int depthKeysAVX(struct ParticleSystem* ps, int begin, int end, float alpha, const float depth[4], 
+		const struct ParticleCull* cull, uint32_t* keys, int* visible) {
+	/* 8 keys per iteration, culled with the same test as packVisibleAVX. 
+	 * AVX has no 256 bit integer ops, so the bits are flipped with float 
+	 * xor and shifted in two halves. Returns the index of the first 
+	 * particle it did not look at.
+	 */
+	const __m256 valpha = _mm256_set1_ps(alpha);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 ones = _mm256_cmp_ps(zero, zero, _CMP_EQ_OQ);
+	const __m256 sign = _mm256_castsi256_ps(_mm256_set1_epi32((int)0x80000000u));
+	const __m256 radius_scale = _mm256_set1_ps(PARTICLE_CULL_RADIUS);
+	const __m256 culled = _mm256_castsi256_ps(_mm256_set1_epi32(PARTICLE_CULLED_KEY));
+	__m256 row[4];
+	for (int c = 0; c < 4; ++c)
+		row[c] = _mm256_set1_ps(depth[c]);
+	__m256 planes[6][4];
+	for (int k = 0; cull != NULL && k < 6; ++k)
+		for (int c = 0; c < 4; ++c)
+			planes[k][c] = _mm256_set1_ps(cull->planes[k][c]);
+
+	int n = 0;
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		__m256 ox = _mm256_loadu_ps(ps->prev_x + i);
+		__m256 oy = _mm256_loadu_ps(ps->prev_y + i);
+		__m256 oz = _mm256_loadu_ps(ps->prev_z + i);
+		__m256 px = _mm256_add_ps(ox, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ps->x + i), ox), valpha));
+		__m256 py = _mm256_add_ps(oy, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ps->y + i), oy), valpha));
+		__m256 pz = _mm256_add_ps(oz, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(ps->z + i), oz), valpha));
+
+		__m256 z = _mm256_add_ps(
+			_mm256_add_ps(_mm256_mul_ps(row[0], px), _mm256_mul_ps(row[1], py)),
+			_mm256_add_ps(_mm256_mul_ps(row[2], pz), row[3])
+		);
+		z = _mm256_add_ps(z, zero); // Like depthKey, -0 to 0
+		__m256 flip = _mm256_blendv_ps(sign, ones, _mm256_cmp_ps(z, zero, _CMP_LT_OQ));
+		__m256 bits = _mm256_xor_ps(z, flip);
+		__m128i low = _mm_srli_epi32(_mm_castps_si128(_mm256_castps256_ps128(bits)), 32 - PARTICLE_DEPTH_BITS);
+		__m128i high = _mm_srli_epi32(_mm_castps_si128(_mm256_extractf128_ps(bits, 1)), 32 - PARTICLE_DEPTH_BITS);
+		__m256 key = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_castsi128_ps(low)), _mm_castsi128_ps(high), 1);
+
+		if (cull != NULL) {
+			__m256 radius = _mm256_mul_ps(_mm256_loadu_ps(ps->size + i), radius_scale);
+			__m256 inside = ones;
+			for (int k = 0; k < 6; ++k) {
+				__m256 d = _mm256_add_ps(
+					_mm256_add_ps(_mm256_mul_ps(planes[k][0], px), _mm256_mul_ps(planes[k][1], py)),
+					_mm256_add_ps(_mm256_mul_ps(planes[k][2], pz), planes[k][3])
+				);
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(d, radius), zero, _CMP_GE_OQ));
+			}
+			key = _mm256_blendv_ps(culled, key, inside);
+			n += __builtin_popcount(_mm256_movemask_ps(inside));
+		} else {
+			n += 8;
+		}
+		_mm256_storeu_ps((float*)(keys + i), key);
+	}
+	*visible += n;
+	return i;
+}
+#endif
+
+int depthKeys(struct ParticleSystem* ps, int begin, int end, float alpha, const float depth[4], const struct ParticleCull* cull, uint32_t* keys) {
+	/* Writes the sort key of the particles [begin, end) to the same slots of
+	 * keys, for their position alpha of the way like in packPositions. With
+	 * cull, the ones outside its frustum get PARTICLE_CULLED_KEY. Returns 
+	 * how many did not.
+	 */
+	int visible = 0;
+#if defined(__AVX__)
+	begin = depthKeysAVX(ps, begin, end, alpha, depth, cull, keys, &visible);
+#endif
+
+	for (int i = begin; i < end; ++i) {
+		float p[3] = {
+			ps->prev_x[i] + (ps->x[i] - ps->prev_x[i]) * alpha,
+			ps->prev_y[i] + (ps->y[i] - ps->prev_y[i]) * alpha,
+			ps->prev_z[i] + (ps->z[i] - ps->prev_z[i]) * alpha,
+		};
+		if (cull != NULL && !insideFrustum(cull, p, ps->size[i] * PARTICLE_CULL_RADIUS)) {
+			keys[i] = PARTICLE_CULLED_KEY;
+			continue;
+		}
+		keys[i] = depthKey(depth[0] * p[0] + depth[1] * p[1] + depth[2] * p[2] + depth[3]);
+		++visible;
+	}
+	return visible;
+}
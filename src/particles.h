@@ -0,0 +1,160 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <cglm/cglm.h>
+
+#include "random.h"
+
+// Every array in a ParticleSystem starts on a cache line and the capacity is
+// rounded up to a multiple of PARTICLE_ALIGN, so loops can run over whole
+// cache lines without a remainder.
+#define PARTICLE_ALIGN 16
+
+// Packs a color so that its bytes in memory are r, g, b, a (little endian),
+// which is what the GL_UNSIGNED_BYTE color attribute reads.
+#define PACK_RGBA(r, g, b, a) \
+	((uint32_t)(r) | (uint32_t)(g) << 8 | (uint32_t)(b) << 16 | (uint32_t)(a) << 24)
+
+// Expiry step of particles that never die
+#define PARTICLE_FOREVER INT32_MAX
+
+/* Structure of arrays, particle i is element i of every array. The first
+ * count are alive, a dead one is replaced by the last live one.
+ */
+struct ParticleSystem {
+	int count;
+	int capacity;
+
+	float* x;
+	float* y;
+	float* z;
+	float* prev_x; // Before the last step, to interpolate
+	float* prev_y;
+	float* prev_z;
+	float* vx;
+	float* vy;
+	float* vz;
+	float* size;
+	uint32_t* color; // PACK_RGBA
+	int32_t* expires; // Step the particle dies at
+
+	int dirty_begin, dirty_end; // Sizes and colors changed, empty when begin >= end
+
+	void* block; // Owns the memory of all arrays
+};
+
+struct ParticleSystem* createParticleSystem(int capacity);
+void destroyParticleSystem(struct ParticleSystem* ps);
+bool reserveParticles(struct ParticleSystem* ps, int capacity);
+void markParticlesDirty(struct ParticleSystem* ps, int begin, int end);
+void clearParticlesDirty(struct ParticleSystem* ps);
+
+/* Spawns rate particles per second of simulated time. They start in a cube
+ * spread wide around pos, with a random speed of up to speed/2 along each 
+ * axis, and live for lifetime steps.
+ */
+struct Emitter {
+	vec3 pos;
+	float spread;
+	float speed;
+	float rate;
+	int lifetime; // 0 lives forever
+	float size;
+	uint32_t color;
+
+	double pending; // Part of a particle left over from the last call
+	struct RandomLanes random;
+};
+
+int addParticle(struct ParticleSystem* ps, vec3 pos, vec3 speed, float size, uint32_t color, int32_t expires);
+int removeDeadParticles(struct ParticleSystem* ps, int32_t now);
+int spawnParticles(struct ParticleSystem* ps, struct Emitter* emitter, int count, int32_t now, bool spread_lifetime);
+int emitParticles(struct ParticleSystem* ps, struct Emitter* emitter, double ms, int32_t now);
+void initParticles(struct ParticleSystem* ps, const struct Emitter* emitter, uint64_t seed, int begin, int end, int32_t now);
+
+/* The SIMD kernels in updateParticles use rsqrt plus one Newton-Raphson step
+ * instead of sqrt and a divide. --verify checks with simdError that the 
+ * velocity change of every particle is within PARTICLE_SIMD_TOLERANCE 
+ * (relative) of updateParticlesScalar.
+ */
+#define PARTICLE_SIMD_TOLERANCE 1e-6f
+
+// Largest positionError the GPU backends may have after a second of steps
+#define PARTICLE_GPU_TOLERANCE 1e-3f
+
+/* How positions are packed for the GPU. POSITION_HALF and POSITION_UNORM16
+ * take 8 bytes per particle instead of 12: x, y, z and a zero to keep every
+ * particle 4 byte aligned. POSITION_UNORM16 is relative to a box, 0 at its
+ * low corner and 65535 at the high one.
+ */
+enum PositionFormat {
+	POSITION_FLOAT,
+	POSITION_HALF,
+	POSITION_UNORM16,
+};
+
+int positionStride(enum PositionFormat format);
+
+/* One simulation step. The last one before a frame keeps the previous
+ * positions and can pack them alpha of the way into positions. Not for
+ * POSITION_UNORM16, which needs particleBounds first.
+ */
+struct ParticleStep {
+	float accel; // Length of the velocity change
+	float dt; // How many times the velocity is added to the position
+	bool keep_previous;
+	float alpha;
+	enum PositionFormat format; // POSITION_FLOAT or POSITION_HALF
+	void* positions; // NULL to not pack
+};
+
+void updateParticles(struct ParticleSystem* ps, int begin, int end, const struct ParticleStep* step);
+void updateParticlesScalar(struct ParticleSystem* ps, int begin, int end, const struct ParticleStep* step);
+void packPositions(struct ParticleSystem* ps, int begin, int end, float alpha, enum PositionFormat format, void* positions);
+float positionError(const struct ParticleSystem* ps, const float* positions, int stride, int count);
+float simdError(const struct ParticleSystem* ps, int count, float accel);
+void particleBounds(struct ParticleSystem* ps, int begin, int end, float bounds[6]);
+void packPositionsUnorm16(struct ParticleSystem* ps, int begin, int end, float alpha, const float bounds[6], uint16_t* positions);
+
+// Frustum culling while packing, a particle is kept if the circle around its
+// quad, size * PARTICLE_CULL_RADIUS across, reaches inside all six planes
+#define PARTICLE_CULL_RADIUS 0.70710678f
+
+struct ParticleCull {
+	vec4 planes[6]; // From glm_frustum_planes, >= 0 inside
+	float alpha;
+	enum PositionFormat format;
+	const float* bounds; // particleBounds box, for POSITION_UNORM16
+};
+
+int packVisible(struct ParticleSystem* ps, int begin, int end, const struct ParticleCull* cull, void* positions, uint32_t* statics);
+
+/* Sort keys for drawing back to front, going up from far to near. depth is
+ * the row of the view matrix that gives view space z. The top 22 bits of the
+ * float are two radix passes and leave 13 bits of mantissa.
+ */
+#define PARTICLE_DEPTH_BITS 22
+#define PARTICLE_CULLED_KEY ((1u << PARTICLE_DEPTH_BITS) - 1)
+
+int depthKeys(struct ParticleSystem* ps, int begin, int end, float alpha, const float depth[4], const struct ParticleCull* cull, uint32_t* keys);
+
+/* Level of detail. Particles closer to camera than distance are packed like
+ * packVisible does, the ones farther away are added to a grid of cubes cell
+ * across instead, to be drawn as an impostor per cube (see lod.h).
+ */
+struct ParticleLod {
+	vec3 camera;
+	float distance;
+	float cell;
+};
+
+struct LodGrid;
+
+int packNear(struct ParticleSystem* ps, int begin, int end, const struct ParticleCull* cull, const struct ParticleLod* lod,
+	struct LodGrid* grid, void* positions, uint32_t* statics);
+void packPoint(const float p[3], enum PositionFormat format, const float bounds[6], void* positions, int slot);
+
+#endif
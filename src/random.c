@@ -0,0 +1,119 @@
+/* xoshiro128+ by David Blackman and Sebastiano Vigna, unlike rand() it takes
+ * no lock and vectorizes. Reference code: https://prng.di.unimi.it/
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "random.h"
+
+static uint64_t splitmix64(uint64_t* state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static uint32_t rotl(uint32_t x, int k) {
+	return (x << k) | (x >> (32 - k));
+}
+
+// The top 24 bits as a float in [0, 1)
+static float toFloat(uint32_t x) {
+	return (float)(x >> 8) * (1.0f / 16777216.0f);
+}
+
+void seedRandom(struct Random* random, uint64_t seed, uint64_t stream) {
+	uint64_t state = seed ^ splitmix64(&stream);
+	uint64_t a = splitmix64(&state);
+	uint64_t b = splitmix64(&state);
+
+	random->s[0] = (uint32_t)a;
+	random->s[1] = (uint32_t)(a >> 32);
+	random->s[2] = (uint32_t)b;
+	random->s[3] = (uint32_t)(b >> 32);
+	if ((a | b) == 0) // The all zero state never leaves zero
+		random->s[0] = 1;
+}
+
+float randomFloat(struct Random* random) {
+	/* Returns a float in [0, 1)
+	 */
+	uint32_t* s = random->s;
+	uint32_t result = s[0] + s[3];
+	uint32_t t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 11);
+
+	return toFloat(result);
+}
+
+void seedRandomLanes(struct RandomLanes* lanes, uint64_t seed, uint64_t stream) {
+	/* Every lane is its own stream, derived from stream.
+	 */
+	for (int lane = 0; lane < RANDOM_LANES; ++lane) {
+		struct Random random;
+		seedRandom(&random, seed, stream * RANDOM_LANES + lane);
+		for (int i = 0; i < 4; ++i)
+			lanes->s[i][lane] = random.s[i];
+	}
+}
+
+#if defined(__AVX2__)
+static void randomBlock(struct RandomLanes* lanes, float* out) {
+	__m256i s0 = _mm256_load_si256((__m256i*)lanes->s[0]);
+	__m256i s1 = _mm256_load_si256((__m256i*)lanes->s[1]);
+	__m256i s2 = _mm256_load_si256((__m256i*)lanes->s[2]);
+	__m256i s3 = _mm256_load_si256((__m256i*)lanes->s[3]);
+
+	__m256i result = _mm256_add_epi32(s0, s3);
+	__m256i t = _mm256_slli_epi32(s1, 9);
+
+	s2 = _mm256_xor_si256(s2, s0);
+	s3 = _mm256_xor_si256(s3, s1);
+	s1 = _mm256_xor_si256(s1, s2);
+	s0 = _mm256_xor_si256(s0, s3);
+	s2 = _mm256_xor_si256(s2, t);
+	s3 = _mm256_or_si256(_mm256_slli_epi32(s3, 11), _mm256_srli_epi32(s3, 21));
+
+	_mm256_store_si256((__m256i*)lanes->s[0], s0);
+	_mm256_store_si256((__m256i*)lanes->s[1], s1);
+	_mm256_store_si256((__m256i*)lanes->s[2], s2);
+	_mm256_store_si256((__m256i*)lanes->s[3], s3);
+
+	__m256 f = _mm256_cvtepi32_ps(_mm256_srli_epi32(result, 8));
+	_mm256_storeu_ps(out, _mm256_mul_ps(f, _mm256_set1_ps(1.0f / 16777216.0f)));
+}
+#else
+static void randomBlock(struct RandomLanes* lanes, float* out) {
+	for (int lane = 0; lane < RANDOM_LANES; ++lane) {
+		struct Random random = {{
+			lanes->s[0][lane], lanes->s[1][lane], lanes->s[2][lane], lanes->s[3][lane]
+		}};
+		out[lane] = randomFloat(&random);
+		for (int i = 0; i < 4; ++i)
+			lanes->s[i][lane] = random.s[i];
+	}
+}
+#endif
+
+void randomFloats(struct RandomLanes* lanes, float* out, int count) {
+	/* Fills out with count floats in [0, 1), RANDOM_LANES at a time. Gives
+	 * the same numbers with and without AVX2.
+	 */
+	int i = 0;
+	for (; i + RANDOM_LANES <= count; i += RANDOM_LANES)
+		randomBlock(lanes, out + i);
+
+	if (i < count) {
+		float rest[RANDOM_LANES];
+		randomBlock(lanes, rest);
+		for (int j = 0; i < count; ++i, ++j)
+			out[i] = rest[j];
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+#define RANDOM_LANES 8
+
+/* xoshiro128+ generators. Every stream of a seed is seeded on its own
+ * through splitmix64, so separate threads or jobs can each take a stream
+ * and get the same numbers no matter which thread ends up running them.
+ */
+struct Random {
+	uint32_t s[4];
+};
+
+// Eight generators side by side for randomFloats, one per SIMD lane
+struct RandomLanes {
+	uint32_t s[4][RANDOM_LANES];
+} __attribute__((aligned(32)));
+
+void seedRandom(struct Random* random, uint64_t seed, uint64_t stream);
+float randomFloat(struct Random* random);
+
+void seedRandomLanes(struct RandomLanes* lanes, uint64_t seed, uint64_t stream);
+void randomFloats(struct RandomLanes* lanes, float* out, int count);
+
+#endif
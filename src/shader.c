@@ -2,6 +2,8 @@
  * contained within this file! We do as little as possible raw
  * OpenGL calls in the actual main.c
  */
+#include <string.h>
+
 #include "shader.h"
 
 char* readShaderSource(const char* sourcePath) {
@@ -90,6 +92,107 @@ uint32_t createProgramVF(const char* vertexSourcePath, const char* fragmentSourc
 	return programVF;
 }
 
+uint32_t createProgramVGF(const char* vertexSourcePath, const char* geometrySourcePath, const char* fragmentSourcePath) {
+	/* Creates and returns the id of a OpenGL program like createProgramVF,
+	 * with a geometry shader in between.
+	 */
+	uint32_t programVGF;
+	uint32_t vertexShader;
+	uint32_t geometryShader;
+	uint32_t fragmentShader;
+
+	vertexShader = compileShader(vertexSourcePath, GL_VERTEX_SHADER);
+	geometryShader = compileShader(geometrySourcePath, GL_GEOMETRY_SHADER);
+	fragmentShader = compileShader(fragmentSourcePath, GL_FRAGMENT_SHADER);
+
+	programVGF = glCreateProgram();
+	glAttachShader(programVGF, vertexShader);
+	glAttachShader(programVGF, geometryShader);
+	glAttachShader(programVGF, fragmentShader);
+	glLinkProgram(programVGF);
+
+	int success;
+	char infolog[512];
+	glGetProgramiv(programVGF, GL_LINK_STATUS, &success);
+	if(!success) {
+		glGetProgramInfoLog(programVGF, 512, NULL, infolog);
+		fprintf(stderr, "Could not link program %s: %s\n", geometrySourcePath, infolog);
+	}
+
+	return programVGF;
+}
+
+uint32_t createProgramFeedback(const char* vertexSourcePath, const char** varyings, int varyingCount) {
+	/* Creates and returns the id of a OpenGL program that only has a vertex
+	 * shader, capturing varyings interleaved for transform feedback.
+	 */
+	uint32_t programFeedback;
+	uint32_t vertexShader;
+
+	vertexShader = compileShader(vertexSourcePath, GL_VERTEX_SHADER);
+
+	programFeedback = glCreateProgram();
+	glAttachShader(programFeedback, vertexShader);
+	glTransformFeedbackVaryings(programFeedback, varyingCount, varyings, GL_INTERLEAVED_ATTRIBS);
+	glLinkProgram(programFeedback);
+
+	int success;
+	char infolog[512];
+	glGetProgramiv(programFeedback, GL_LINK_STATUS, &success);
+	if(!success) {
+		glGetProgramInfoLog(programFeedback, 512, NULL, infolog);
+		fprintf(stderr, "Could not link program %s: %s\n", vertexSourcePath, infolog);
+	}
+
+	return programFeedback;
+}
+
+uint32_t createProgramCompute(const char* computeSourcePath, const char* defines) {
+	/* Creates and returns the id of a OpenGL program with one compute shader,
+	 * with defines put right after the #version line. Needs GL 4.3.
+	 */
+	uint32_t programCompute;
+	uint32_t computeShader;
+	char* shaderSource;
+
+	shaderSource = readShaderSource(computeSourcePath);
+	if (shaderSource == NULL) {
+		fprintf(stderr, "Could not read shader %s\n", computeSourcePath);
+		return 0;
+	}
+
+	// The #version line has to stay first
+	char* body = strchr(shaderSource, '\n');
+	body = body != NULL ? body + 1 : shaderSource + strlen(shaderSource);
+	const char* sources[3] = {shaderSource, defines, body};
+	int lengths[3] = {(int)(body - shaderSource), (int)strlen(defines), -1};
+
+	computeShader = glCreateShader(GL_COMPUTE_SHADER);
+	glShaderSource(computeShader, 3, sources, lengths);
+	glCompileShader(computeShader);
+	free(shaderSource);
+
+	int success;
+	char infolog[512];
+	glGetShaderiv(computeShader, GL_COMPILE_STATUS, &success);
+	if (!success) {
+		glGetShaderInfoLog(computeShader, 512, NULL, infolog);
+		fprintf(stderr, "Could not compile shader %s: %s\n", computeSourcePath, infolog);
+	}
+
+	programCompute = glCreateProgram();
+	glAttachShader(programCompute, computeShader);
+	glLinkProgram(programCompute);
+
+	glGetProgramiv(programCompute, GL_LINK_STATUS, &success);
+	if(!success) {
+		glGetProgramInfoLog(programCompute, 512, NULL, infolog);
+		fprintf(stderr, "Could not link program %s: %s\n", computeSourcePath, infolog);
+	}
+
+	return programCompute;
+}
+
 /**
  * uniform;
  * @program: The shader program to set the uniform in.
@@ -7,6 +7,9 @@
 #include <cglm/cglm.h>
 
 uint32_t createProgramVF(const char* vertexSourcePath, const char* fragmentSourcePath);
+uint32_t createProgramVGF(const char* vertexSourcePath, const char* geometrySourcePath, const char* fragmentSourcePath);
+uint32_t createProgramFeedback(const char* vertexSourcePath, const char** varyings, int varyingCount);
+uint32_t createProgramCompute(const char* computeSourcePath, const char* defines);
 
 // Uniforms
 void uniform1fv(uint32_t program, const char* uniformName, int count, float* value);
@@ -0,0 +1,266 @@
+/* The depth sort, a parallel LSD radix sort. Every pass counts the digits
+ * per block, then moves each block to places no other block writes to.
+ * Passes where every item has the same digit are skipped.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "sort.h"
+
+struct SortPass {
+	struct DepthSort* sort;
+	int shift; // Of the digit, in the key
+	const uint64_t* src;
+	uint64_t* dst;
+};
+
+static inline uint32_t digitOf(uint64_t item, int shift) {
+	return (uint32_t)(item >> (32 + shift)) & (SORT_BUCKETS - 1);
+}
+
+bool createDepthSort(struct DepthSort* sort, int blocks) {
+	/* blocks is how many jobs every pass is split into, the thread count
+	 * works well. Nothing is allocated for particles until reserveDepthSort.
+	 */
+	memset(sort, 0, sizeof(*sort));
+	sort->block_count = blocks > 0 ? blocks : 1;
+	sort->blocks = malloc(sizeof(struct SortBlock) * sort->block_count);
+	return sort->blocks != NULL;
+}
+
+void destroyDepthSort(struct DepthSort* sort) {
+	free(sort->keys);
+	free(sort->positions);
+	free(sort->statics);
+	free(sort->items);
+	free(sort->spare);
+	free(sort->range_first);
+	free(sort->range_count);
+	free(sort->blocks);
+}
+
+bool reserveDepthSort(struct DepthSort* sort, int capacity, int stride) {
+	/* Makes room for capacity arena slots of stride byte positions. The
+	 * statics of the slots there already are kept. Returns false if the
+	 * memory could not be allocated, sort is then left as it was.
+	 */
+	if (capacity <= sort->capacity && stride == sort->stride)
+		return true;
+
+	uint32_t* keys = realloc(sort->keys, sizeof(uint32_t) * capacity);
+	if (keys == NULL)
+		return false;
+	sort->keys = keys;
+
+	void* positions = realloc(sort->positions, (size_t)capacity * stride);
+	if (positions == NULL)
+		return false;
+	sort->positions = positions;
+
+	uint32_t* statics = realloc(sort->statics, sizeof(uint32_t) * 2 * capacity);
+	if (statics == NULL)
+		return false;
+	sort->statics = statics;
+
+	sort->capacity = capacity;
+	sort->stride = stride;
+	return true;
+}
+
+void copySortStatics(struct DepthSort* sort, int base, const float* size, const uint32_t* color, int begin, int end) {
+	/* Copies size and color of the slots [begin, end) to statics from base
+	 * on, like uploadInstanceStatic does for the static instance buffer.
+	 */
+	if (base + end > sort->capacity)
+		end = sort->capacity - base;
+
+	uint32_t* out = sort->statics + 2 * base;
+	for (int i = begin; i < end; ++i) {
+		memcpy(&out[2*i], &size[i], sizeof(float));
+		out[2*i+1] = color[i];
+	}
+}
+
+static void gatherKeys(void* data, int begin, int end) {
+	/* Puts this frame's key in front of every slot, in the order of the last
+	 * frame, and counts the low digits for the first pass on the way.
+	 */
+	struct SortPass* pass = data;
+	struct DepthSort* sort = pass->sort;
+
+	for (int b = begin; b < end; ++b) {
+		struct SortBlock* block = &sort->blocks[b];
+		memset(block->counts, 0, sizeof(block->counts));
+		block->sorted = true;
+		if (block->begin >= block->end)
+			continue;
+
+		uint32_t last = 0;
+		for (int i = block->begin; i < block->end; ++i) {
+			uint32_t slot = (uint32_t)sort->items[i];
+			uint32_t key = sort->keys[slot];
+			sort->items[i] = (uint64_t)key << 32 | slot;
+			++block->counts[key & (SORT_BUCKETS - 1)];
+			block->sorted &= key >= last;
+			last = key;
+		}
+		block->first_key = (uint32_t)(sort->items[block->begin] >> 32);
+		block->last_key = last;
+	}
+}
+
+static void countDigits(void* data, int begin, int end) {
+	struct SortPass* pass = data;
+	for (int b = begin; b < end; ++b) {
+		struct SortBlock* block = &pass->sort->blocks[b];
+		memset(block->counts, 0, sizeof(block->counts));
+		for (int i = block->begin; i < block->end; ++i)
+			++block->counts[digitOf(pass->src[i], pass->shift)];
+	}
+}
+
+static void scatterDigits(void* data, int begin, int end) {
+	/* Moves the items of the blocks to where countDigits and placeDigits
+	 * said, in order, which keeps the pass stable.
+	 */
+	struct SortPass* pass = data;
+	for (int b = begin; b < end; ++b) {
+		struct SortBlock* block = &pass->sort->blocks[b];
+		for (int i = block->begin; i < block->end; ++i) {
+			uint64_t item = pass->src[i];
+			pass->dst[block->counts[digitOf(item, pass->shift)]++] = item;
+		}
+	}
+}
+
+static bool placeDigits(struct DepthSort* sort) {
+	/* Turns the counts of every block into where its items of each digit
+	 * go: after all items with lower digits, and after the ones of the same
+	 * digit in earlier blocks. Returns false if one digit has every item,
+	 * the pass can be skipped then.
+	 */
+	uint32_t place = 0;
+	for (int d = 0; d < SORT_BUCKETS; ++d) {
+		uint32_t start = place;
+		for (int b = 0; b < sort->block_count; ++b) {
+			uint32_t count = sort->blocks[b].counts[d];
+			sort->blocks[b].counts[d] = place;
+			place += count;
+		}
+		if (place - start == (uint32_t)sort->count)
+			return false;
+	}
+	return true;
+}
+
+void sortDepth(struct DepthSort* sort, struct ThreadPool* pool, const int* first, const int* count, int ranges) {
+	/* Orders the slots of the ranges of the arena by their keys, lowest
+	 * first, starting from the order the same ranges had the last time.
+	 * items holds the result, the slot in the low 32 bits of each.
+	 */
+	int total = 0;
+	for (int r = 0; r < ranges; ++r)
+		total += count[r];
+
+	if (total > sort->item_capacity) {
+		int capacity = total * 2;
+		uint64_t* items = realloc(sort->items, sizeof(uint64_t) * capacity);
+		uint64_t* spare = realloc(sort->spare, sizeof(uint64_t) * capacity);
+		if (items != NULL)
+			sort->items = items;
+		if (spare != NULL)
+			sort->spare = spare;
+		if (items == NULL || spare == NULL) {
+			sort->count = 0;
+			return;
+		}
+		sort->item_capacity = capacity;
+	}
+
+	// Spawning, dying and growing change the slots, start over from the
+	// arena's order then
+	bool same = ranges == sort->ranges && total == sort->count
+		&& memcmp(first, sort->range_first, sizeof(int) * ranges) == 0
+		&& memcmp(count, sort->range_count, sizeof(int) * ranges) == 0;
+	if (!same) {
+		int i = 0;
+		for (int r = 0; r < ranges; ++r)
+			for (int slot = first[r]; slot < first[r] + count[r]; ++slot)
+				sort->items[i++] = (uint32_t)slot;
+
+		free(sort->range_first);
+		free(sort->range_count);
+		sort->range_first = malloc(sizeof(int) * (ranges > 0 ? ranges : 1));
+		sort->range_count = malloc(sizeof(int) * (ranges > 0 ? ranges : 1));
+		sort->ranges = ranges;
+		if (sort->range_first == NULL || sort->range_count == NULL)
+			sort->ranges = 0;
+		else {
+			memcpy(sort->range_first, first, sizeof(int) * ranges);
+			memcpy(sort->range_count, count, sizeof(int) * ranges);
+		}
+	}
+	sort->count = total;
+	sort->passes = 0;
+
+	int blocks = sort->block_count;
+	for (int b = 0; b < blocks; ++b) {
+		sort->blocks[b].begin = (int)((long)total * b / blocks);
+		sort->blocks[b].end = (int)((long)total * (b + 1) / blocks);
+	}
+
+	struct SortPass pass = {sort, 0, sort->items, sort->spare};
+	parallelFor(pool, 0, blocks, 1, gatherKeys, &pass);
+
+	// Still in order, nothing to do
+	bool sorted = true;
+	uint32_t last = 0;
+	for (int b = 0; b < blocks; ++b) {
+		struct SortBlock* block = &sort->blocks[b];
+		if (block->begin >= block->end)
+			continue;
+		sorted &= block->sorted && block->first_key >= last;
+		last = block->last_key;
+	}
+	if (sorted)
+		return;
+
+	for (int p = 0; p < SORT_PASSES; ++p) {
+		pass.shift = p * SORT_DIGIT_BITS;
+		pass.src = sort->items;
+		pass.dst = sort->spare;
+		if (p > 0)
+			parallelFor(pool, 0, blocks, 1, countDigits, &pass);
+		if (!placeDigits(sort))
+			continue;
+
+		parallelFor(pool, 0, blocks, 1, scatterDigits, &pass);
+		sort->spare = sort->items;
+		sort->items = pass.dst;
+		++sort->passes;
+	}
+}
+
+void gatherSorted(const struct DepthSort* sort, int begin, int end, void* positions, uint32_t* statics) {
+	/* Copies the positions and statics of the sorted items [begin, end) to
+	 * positions and statics, item i to slot i.
+	 */
+	const uint64_t* items = sort->items;
+	const uint32_t* static_in = sort->statics;
+	for (int i = begin; i < end; ++i) {
+		uint32_t slot = (uint32_t)items[i];
+		statics[2*i+0] = static_in[2*slot+0];
+		statics[2*i+1] = static_in[2*slot+1];
+	}
+
+	// The two strides as constants, so the copies are plain moves
+	const char* in = sort->positions;
+	char* out = positions;
+	if (sort->stride == 8) {
+		for (int i = begin; i < end; ++i)
+			memcpy(out + 8*i, in + 8*(size_t)(uint32_t)items[i], 8);
+	} else {
+		for (int i = begin; i < end; ++i)
+			memcpy(out + 12*i, in + 12*(size_t)(uint32_t)items[i], 12);
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+// Digits of the radix sort. Only the low SORT_PASSES * SORT_DIGIT_BITS
+// bits of the keys are sorted, PARTICLE_DEPTH_BITS of them.
+#define SORT_DIGIT_BITS 11
+#define SORT_BUCKETS (1 << SORT_DIGIT_BITS)
+#define SORT_PASSES 2
+
+/* Back to front order of the particles for alpha blending. The update jobs
+ * write keys and positions per arena slot here, sortDepth orders the slots
+ * starting from the last frame's order, and the frame gathers in that order.
+ */
+struct SortBlock {
+	int begin, end;
+	bool sorted;
+	uint32_t first_key, last_key;
+	uint32_t counts[SORT_BUCKETS]; // Then where each digit goes
+};
+
+struct DepthSort {
+	int capacity; // Arena slots
+	int stride; // Of positions
+	uint32_t* keys;
+	void* positions;
+	uint32_t* statics; // Size and color per slot, copied where they changed
+
+	// key << 32 | slot, the sorted ones first. Only count are in use.
+	int count;
+	int item_capacity;
+	uint64_t* items;
+	uint64_t* spare;
+
+	// The slots that were sorted last time, ranges of the arena
+	int ranges;
+	int* range_first;
+	int* range_count;
+
+	int block_count;
+	struct SortBlock* blocks;
+	int passes; // Run by the last sortDepth, 0 if it was still sorted
+};
+
+bool createDepthSort(struct DepthSort* sort, int blocks);
+void destroyDepthSort(struct DepthSort* sort);
+bool reserveDepthSort(struct DepthSort* sort, int capacity, int stride);
+void copySortStatics(struct DepthSort* sort, int base, const float* size, const uint32_t* color, int begin, int end);
+void sortDepth(struct DepthSort* sort, struct ThreadPool* pool, const int* first, const int* count, int ranges);
+void gatherSorted(const struct DepthSort* sort, int begin, int end, void* positions, uint32_t* statics);
+
+#endif
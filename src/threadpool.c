@@ -0,0 +1,388 @@
+/* A work stealing job system. Every thread pops its own jobs from the bottom
+ * of a Chase-Lev deque and steals from the top of the others. Thread 0 is
+ * the one that created the pool. Only threads of the pool may submit jobs.
+ *
+ * Background jobs go to a FIFO that only idle workers and runOneJob take from.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "threadpool.h"
+
+// Must be a power of two. A push to a full deque runs the job right away.
+#define DEQUE_SIZE 1024
+
+// Must be a power of two, submitBackgroundJob fails when it is full
+#define BACKGROUND_SIZE 256
+
+// More chunks than threads lets fast threads steal from slow ones
+#define CHUNKS_PER_THREAD 4
+
+struct Deque {
+	long top;    // Stolen from here
+	long bottom; // Owner pushes and pops here
+	struct Job* jobs[DEQUE_SIZE];
+} __attribute__((aligned(64)));
+
+struct ThreadPool {
+	int thread_count;
+	pthread_t* threads;
+	struct Deque* deques;
+
+	int queued;   // Jobs in any deque or the background FIFO
+	int sleeping; // Workers waiting on wake_cond
+
+	// Taken from head, under lock
+	struct Job* background[BACKGROUND_SIZE];
+	long background_head, background_tail;
+
+	// parallelFor's, one call at a time, as many as rangeChunkSize makes
+	struct Job* range_jobs;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake_cond;
+	bool shutdown;
+};
+
+struct Worker {
+	struct ThreadPool* pool;
+	int index;
+};
+
+static __thread int current_thread = 0;
+
+// Chase-Lev deque, following "Correct and Efficient Work-Stealing for Weak
+// Memory Models" (Le, Pop, Cohen, Zappa Nardelli 2013) with a fixed buffer.
+// --------------------------------------------------------------------------
+
+static bool dequePush(struct Deque* d, struct Job* job) {
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	if (b - t >= DEQUE_SIZE)
+		return false;
+
+	__atomic_store_n(&d->jobs[b & (DEQUE_SIZE - 1)], job, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+static struct Job* dequePop(struct Deque* d) {
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+	struct Job* job = NULL;
+	if (t <= b) {
+		job = __atomic_load_n(&d->jobs[b & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+		if (t == b) {
+			// Last job, race the thieves for it
+			if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+				job = NULL;
+			__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return job;
+}
+
+static struct Job* dequeSteal(struct Deque* d) {
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b)
+		return NULL;
+
+	struct Job* job = __atomic_load_n(&d->jobs[t & (DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL; // Lost to another thief or the owner
+	return job;
+}
+
+// Scheduling
+// ----------
+
+static void runJob(struct ThreadPool* pool, struct Job* job);
+
+static void wakeWorkers(struct ThreadPool* pool) {
+	// queued and sleeping are both seq_cst, so either this sees the sleeper
+	// or the sleeper sees the job before it waits
+	if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->wake_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void pushJob(struct ThreadPool* pool, struct Job* job) {
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	if (!dequePush(&pool->deques[current_thread], job)) {
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+		runJob(pool, job);
+		return;
+	}
+	wakeWorkers(pool);
+}
+
+static struct Job* takeBackground(struct ThreadPool* pool) {
+	if (__atomic_load_n(&pool->background_head, __ATOMIC_ACQUIRE)
+			== __atomic_load_n(&pool->background_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	struct Job* job = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->background_head != pool->background_tail) {
+		job = pool->background[pool->background_head & (BACKGROUND_SIZE - 1)];
+		__atomic_store_n(&pool->background_head, pool->background_head + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return job;
+}
+
+static struct Job* findJob(struct ThreadPool* pool, bool background) {
+	int self = current_thread;
+	struct Job* job = dequePop(&pool->deques[self]);
+
+	for (int i = 1; job == NULL && i < pool->thread_count; ++i)
+		job = dequeSteal(&pool->deques[(self + i) % pool->thread_count]);
+
+	if (job == NULL && background)
+		job = takeBackground(pool);
+
+	if (job != NULL)
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	return job;
+}
+
+static void runJob(struct ThreadPool* pool, struct Job* job) {
+	if (job->func != NULL)
+		job->func(job->data, job->begin, job->end);
+
+	// The owner may reuse job as soon as it is done, and a continuation can
+	// be what the owner waits for, so copy them out and mark it done first
+	int count = job->continuation_count;
+	struct Job* continuations[JOB_MAX_CONTINUATIONS];
+	for (int i = 0; i < count; ++i)
+		continuations[i] = job->continuations[i];
+
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+
+	for (int i = 0; i < count; ++i) {
+		struct Job* next = continuations[i];
+		if (__atomic_sub_fetch(&next->pending, 1, __ATOMIC_ACQ_REL) == 0)
+			pushJob(pool, next);
+	}
+}
+
+static void* workerMain(void* arg) {
+	struct Worker* worker = arg;
+	struct ThreadPool* pool = worker->pool;
+	current_thread = worker->index;
+	free(worker);
+
+	for (;;) {
+		struct Job* job = findJob(pool, true);
+		if (job != NULL) {
+			runJob(pool, job);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		__atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->wake_cond, &pool->lock);
+		__atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+		bool shutdown = pool->shutdown;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (shutdown)
+			break;
+	}
+
+	return NULL;
+}
+
+// Pool
+// ----
+
+struct ThreadPool* createThreadPool(int thread_count) {
+	/* Creates a pool of thread_count threads, the calling thread included.
+	 * Returns NULL on failure.
+	 */
+	struct ThreadPool* pool = calloc(1, sizeof(struct ThreadPool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->thread_count = thread_count > 0 ? thread_count : 1;
+	pool->threads = malloc(sizeof(pthread_t) * pool->thread_count);
+	pool->deques = calloc(pool->thread_count, sizeof(struct Deque));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake_cond, NULL);
+
+	current_thread = 0;
+	for (int i = 1; i < pool->thread_count; ++i) {
+		struct Worker* worker = malloc(sizeof(struct Worker));
+		worker->pool = pool;
+		worker->index = i;
+		if (pthread_create(&pool->threads[i], NULL, workerMain, worker) != 0) {
+			free(worker);
+			pool->thread_count = i; // Run with the threads we got
+			break;
+		}
+	}
+	pool->range_jobs = malloc(sizeof(struct Job) * pool->thread_count * CHUNKS_PER_THREAD);
+
+	return pool;
+}
+
+void destroyThreadPool(struct ThreadPool* pool) {
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->wake_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 1; i < pool->thread_count; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->wake_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->range_jobs);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
+
+int threadCount(struct ThreadPool* pool) {
+	return pool->thread_count;
+}
+
+int rangeChunkSize(struct ThreadPool* pool, int count, int alignment) {
+	/* Size of the chunks to split count elements into so that every thread
+	 * gets a few of them. Always a multiple of alignment and at least 1.
+	 */
+	int chunks = pool->thread_count * CHUNKS_PER_THREAD;
+	int chunk = (count + chunks - 1) / chunks;
+	chunk = (chunk + alignment - 1) / alignment * alignment;
+	return chunk > 0 ? chunk : alignment;
+}
+
+// Jobs
+// ----
+
+void initJob(struct Job* job, RangeFunc func, void* data, int begin, int end) {
+	job->func = func;
+	job->data = data;
+	job->begin = begin;
+	job->end = end;
+	job->pending = 1;
+	job->done = 0;
+	job->continuation_count = 0;
+}
+
+bool jobDependsOn(struct Job* job, struct Job* dependency) {
+	/* Makes job wait for dependency. Neither may have been submitted yet.
+	 * Returns false if dependency already has JOB_MAX_CONTINUATIONS, put a
+	 * join job in between in that case.
+	 */
+	if (dependency->continuation_count >= JOB_MAX_CONTINUATIONS)
+		return false;
+
+	dependency->continuations[dependency->continuation_count++] = job;
+	++job->pending;
+	return true;
+}
+
+void submitJob(struct ThreadPool* pool, struct Job* job) {
+	if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		pushJob(pool, job);
+}
+
+bool submitBackgroundJob(struct ThreadPool* pool, struct Job* job) {
+	/* Queues a job without dependencies to run when a thread has nothing
+	 * else to do, in the order they were submitted. Returns false if the
+	 * FIFO is full, the job is not submitted then.
+	 */
+	pthread_mutex_lock(&pool->lock);
+	bool full = pool->background_tail - pool->background_head >= BACKGROUND_SIZE;
+	if (!full) {
+		--job->pending;
+		pool->background[pool->background_tail & (BACKGROUND_SIZE - 1)] = job;
+		__atomic_store_n(&pool->background_tail, pool->background_tail + 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!full)
+		wakeWorkers(pool);
+	return !full;
+}
+
+bool jobDone(struct Job* job) {
+	return __atomic_load_n(&job->done, __ATOMIC_ACQUIRE) != 0;
+}
+
+void waitJob(struct ThreadPool* pool, struct Job* job) {
+	/* Runs other jobs until job is done.
+	 */
+	while (!jobDone(job)) {
+		struct Job* other = findJob(pool, false);
+		if (other != NULL)
+			runJob(pool, other);
+		else
+			sched_yield(); // The rest is running on other threads
+	}
+}
+
+bool runOneJob(struct ThreadPool* pool) {
+	/* Runs the oldest background job, or else the oldest job of the first
+	 * deque that has one. Lets the caller make progress on background jobs
+	 * between frames in the order they were submitted.
+	 */
+	int self = current_thread;
+	struct Job* job = takeBackground(pool);
+	for (int i = 0; job == NULL && i < pool->thread_count; ++i)
+		job = dequeSteal(&pool->deques[(self + i) % pool->thread_count]);
+
+	if (job == NULL)
+		return false;
+	__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	runJob(pool, job);
+	return true;
+}
+
+void parallelFor(struct ThreadPool* pool, int begin, int end, int alignment, RangeFunc func, void* data) {
+	/* Splits [begin, end) into chunks that all start at a multiple of
+	 * alignment from begin, and returns when every chunk has run. With
+	 * alignment at a cache line worth of elements no two threads write to
+	 * the same cache line.
+	 */
+	if (end <= begin)
+		return;
+	if (pool->range_jobs == NULL) {
+		func(data, begin, end);
+		return;
+	}
+
+	int chunk = rangeChunkSize(pool, end - begin, alignment);
+	int chunk_count = (end - begin + chunk - 1) / chunk;
+
+	struct Job* jobs = pool->range_jobs;
+	for (int i = 0; i < chunk_count; ++i) {
+		int first = begin + i * chunk;
+		initJob(&jobs[i], func, data, first, first + chunk < end ? first + chunk : end);
+	}
+	for (int i = 0; i < chunk_count; ++i)
+		submitJob(pool, &jobs[i]);
+	for (int i = 0; i < chunk_count; ++i)
+		waitJob(pool, &jobs[i]);
+}
@@ -0,0 +1,46 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdbool.h>
+
+// Work on the range [begin, end)
+typedef void (*RangeFunc)(void* data, int begin, int end);
+
+#define JOB_MAX_CONTINUATIONS 4
+
+/* A piece of work for the pool. Jobs are owned by the caller and must stay
+ * alive until they are done. Build the whole graph with jobDependsOn before
+ * submitting any of its jobs, a job then runs once it has been submitted and
+ * all of its dependencies are done.
+ */
+struct Job {
+	RangeFunc func; // May be NULL for jobs that only join others
+	void* data;
+	int begin, end;
+
+	int pending; // Dependencies left, plus one until submitted
+	int done;
+
+	int continuation_count;
+	struct Job* continuations[JOB_MAX_CONTINUATIONS];
+};
+
+struct ThreadPool;
+
+struct ThreadPool* createThreadPool(int thread_count);
+void destroyThreadPool(struct ThreadPool* pool);
+
+int threadCount(struct ThreadPool* pool);
+int rangeChunkSize(struct ThreadPool* pool, int count, int alignment);
+
+void initJob(struct Job* job, RangeFunc func, void* data, int begin, int end);
+bool jobDependsOn(struct Job* job, struct Job* dependency);
+void submitJob(struct ThreadPool* pool, struct Job* job);
+bool submitBackgroundJob(struct ThreadPool* pool, struct Job* job);
+void waitJob(struct ThreadPool* pool, struct Job* job);
+bool jobDone(struct Job* job);
+bool runOneJob(struct ThreadPool* pool);
+
+void parallelFor(struct ThreadPool* pool, int begin, int end, int alignment, RangeFunc func, void* data);
+
+#endif
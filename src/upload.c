@@ -0,0 +1,375 @@
+/* The upload thread. Every buffer of the ring goes around the same states,
+ * moved on under the lock, with the GL calls made outside it. The render
+ * thread draws the buffer of the frame before while its own one unmaps.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <GL/glew.h>
+#include <GL/gl.h>
+
+#include "upload.h"
+
+static const GLbitfield upload_map_flags =
+	GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_FLUSH_EXPLICIT_BIT;
+
+enum BufferState {
+	BUFFER_FREE,    // Not mapped, the upload thread maps it
+	BUFFER_MAPPED,  // Mapped ahead of time
+	BUFFER_RESIZE,  // Mapped but too small, the upload thread grows it
+	BUFFER_WRITING, // Handed to the render thread
+	BUFFER_FILLED,  // Written, the upload thread unmaps and fences it
+	BUFFER_READY,   // The render thread may draw it once the fence is done
+	BUFFER_DRAWING,
+	BUFFER_DRAWN,   // Fenced after drawing, free when the GPU is done
+};
+
+struct UploadBuffer {
+	enum BufferState state;
+	uint32_t name;
+	size_t size; // Of the storage
+	void* mapped;
+	size_t written;
+	GLsync fence; // The upload's when READY, the draw's when DRAWN
+	uint64_t frame; // Newer frames are bigger
+};
+
+struct UploadThread {
+	SDL_Window* window; // Hidden, a context needs a window to be current
+	SDL_GLContext context;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool started;
+	bool failed;
+	bool shutdown;
+
+	struct UploadBuffer buffers[UPLOAD_THREAD_BUFFERS];
+	size_t capacity; // Storage size new buffers get, 0 until the first frame
+	int next; // Handed out by the next beginUploadBuffer
+	uint64_t frame;
+};
+
+static double millisecondsSince(uint64_t start) {
+	return (double)((SDL_GetPerformanceCounter() - start)*1000) / SDL_GetPerformanceFrequency();
+}
+
+// Upload thread
+// -------------
+
+static struct UploadBuffer* findWork(struct UploadThread* upload) {
+	/* Unmapping comes first, the render thread may be waiting to draw.
+	 * Waiting for the GPU to finish drawing comes last.
+	 */
+	static const enum BufferState order[] = {BUFFER_FILLED, BUFFER_RESIZE, BUFFER_FREE, BUFFER_DRAWN};
+
+	for (int k = 0; k < 4; ++k) {
+		if (order[k] == BUFFER_FREE && upload->capacity == 0)
+			continue;
+		for (int i = 0; i < UPLOAD_THREAD_BUFFERS; ++i)
+			if (upload->buffers[i].state == order[k])
+				return &upload->buffers[i];
+	}
+	return NULL;
+}
+
+static enum BufferState mapBuffer(struct UploadBuffer* buffer, size_t capacity) {
+	glBindBuffer(GL_ARRAY_BUFFER, buffer->name);
+	if (buffer->mapped != NULL) {
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		buffer->mapped = NULL;
+	}
+	if (buffer->size < capacity) {
+		glBufferData(GL_ARRAY_BUFFER, capacity, NULL, GL_STREAM_DRAW);
+		buffer->size = capacity;
+	}
+
+	buffer->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, buffer->size, upload_map_flags);
+	if (buffer->mapped == NULL)
+		fprintf(stderr, "Could not map an upload buffer\n");
+	return BUFFER_MAPPED;
+}
+
+static enum BufferState unmapBuffer(struct UploadBuffer* buffer) {
+	/* Only the written part goes to the GPU.
+	 */
+	glBindBuffer(GL_ARRAY_BUFFER, buffer->name);
+	if (buffer->mapped != NULL) {
+		glFlushMappedBufferRange(GL_ARRAY_BUFFER, 0, buffer->written);
+		if (glUnmapBuffer(GL_ARRAY_BUFFER) != GL_TRUE)
+			buffer->written = 0; // Lost, nothing to draw
+		buffer->mapped = NULL;
+	}
+
+	// Flushed so the render thread's wait on it can finish
+	buffer->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+	return BUFFER_READY;
+}
+
+static enum BufferState waitDrawn(struct UploadBuffer* buffer, size_t capacity) {
+	GLenum result;
+	do {
+		result = glClientWaitSync(buffer->fence, 0, 1000000); // 1 ms
+	} while (result == GL_TIMEOUT_EXPIRED);
+	glDeleteSync(buffer->fence);
+	buffer->fence = NULL;
+
+	return capacity > 0 ? mapBuffer(buffer, capacity) : BUFFER_FREE;
+}
+
+static void* uploadMain(void* arg) {
+	struct UploadThread* upload = arg;
+	bool current = SDL_GL_MakeCurrent(upload->window, upload->context) == 0;
+	if (current) {
+		for (int i = 0; i < UPLOAD_THREAD_BUFFERS; ++i)
+			glGenBuffers(1, &upload->buffers[i].name);
+	}
+
+	pthread_mutex_lock(&upload->lock);
+	upload->started = true;
+	upload->failed = !current;
+	pthread_cond_broadcast(&upload->cond);
+
+	while (current && !upload->shutdown) {
+		struct UploadBuffer* buffer = findWork(upload);
+		if (buffer == NULL) {
+			pthread_cond_wait(&upload->cond, &upload->lock);
+			continue;
+		}
+
+		enum BufferState state = buffer->state;
+		size_t capacity = upload->capacity;
+		pthread_mutex_unlock(&upload->lock);
+
+		if (state == BUFFER_FILLED)
+			state = unmapBuffer(buffer);
+		else if (state == BUFFER_DRAWN)
+			state = waitDrawn(buffer, capacity);
+		else
+			state = mapBuffer(buffer, capacity);
+
+		pthread_mutex_lock(&upload->lock);
+		buffer->state = state;
+		pthread_cond_broadcast(&upload->cond);
+	}
+	pthread_mutex_unlock(&upload->lock);
+
+	if (!current)
+		return NULL;
+
+	for (int i = 0; i < UPLOAD_THREAD_BUFFERS; ++i) {
+		struct UploadBuffer* buffer = &upload->buffers[i];
+		if (buffer->mapped != NULL) {
+			glBindBuffer(GL_ARRAY_BUFFER, buffer->name);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		if (buffer->fence != NULL)
+			glDeleteSync(buffer->fence);
+		glDeleteBuffers(1, &buffer->name);
+	}
+	glFinish();
+	SDL_GL_MakeCurrent(upload->window, NULL);
+	return NULL;
+}
+
+// Render thread
+// -------------
+
+struct UploadThread* createUploadThread(SDL_Window* window, SDL_GLContext context) {
+	/* Starts the thread with a context shared with context, which has to be
+	 * current on the calling thread and stays so. Returns NULL on failure.
+	 */
+	struct UploadThread* upload = calloc(1, sizeof(struct UploadThread));
+	if (upload == NULL)
+		return NULL;
+
+	upload->window = SDL_CreateWindow("", 0, 0, 1, 1, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+	if (upload->window == NULL) {
+		free(upload);
+		return NULL;
+	}
+
+	// Creating a context also makes it current
+	SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 1);
+	upload->context = SDL_GL_CreateContext(upload->window);
+	SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 0);
+	SDL_GL_MakeCurrent(window, context);
+	if (upload->context == NULL) {
+		fprintf(stderr, "Could not create the upload context: %s\n", SDL_GetError());
+		SDL_DestroyWindow(upload->window);
+		free(upload);
+		return NULL;
+	}
+
+	pthread_mutex_init(&upload->lock, NULL);
+	pthread_cond_init(&upload->cond, NULL);
+	for (int i = 0; i < UPLOAD_THREAD_BUFFERS; ++i)
+		upload->buffers[i].state = BUFFER_FREE;
+
+	bool ok = pthread_create(&upload->thread, NULL, uploadMain, upload) == 0;
+	if (ok) {
+		pthread_mutex_lock(&upload->lock);
+		while (!upload->started)
+			pthread_cond_wait(&upload->cond, &upload->lock);
+		ok = !upload->failed;
+		pthread_mutex_unlock(&upload->lock);
+		if (!ok)
+			pthread_join(upload->thread, NULL);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Could not start the upload thread\n");
+		pthread_cond_destroy(&upload->cond);
+		pthread_mutex_destroy(&upload->lock);
+		SDL_GL_DeleteContext(upload->context);
+		SDL_DestroyWindow(upload->window);
+		free(upload);
+		return NULL;
+	}
+	return upload;
+}
+
+void destroyUploadThread(struct UploadThread* upload) {
+	if (upload == NULL)
+		return;
+
+	pthread_mutex_lock(&upload->lock);
+	upload->shutdown = true;
+	pthread_cond_broadcast(&upload->cond);
+	pthread_mutex_unlock(&upload->lock);
+	pthread_join(upload->thread, NULL);
+
+	pthread_cond_destroy(&upload->cond);
+	pthread_mutex_destroy(&upload->lock);
+	SDL_GL_DeleteContext(upload->context);
+	SDL_DestroyWindow(upload->window);
+	free(upload);
+}
+
+void* beginUploadBuffer(struct UploadThread* upload, size_t size, size_t capacity, int* buffer, double* wait_ms) {
+	/* Takes the next buffer of the ring, mapped with room for at least size
+	 * bytes, and sets buffer to its index. New buffers get storage for
+	 * capacity bytes. Returns NULL if it could not be mapped.
+	 */
+	uint64_t start = SDL_GetPerformanceCounter();
+	struct UploadBuffer* next = &upload->buffers[upload->next];
+
+	pthread_mutex_lock(&upload->lock);
+	if (capacity > upload->capacity) {
+		upload->capacity = capacity;
+		pthread_cond_broadcast(&upload->cond);
+	}
+
+	while (!(next->state == BUFFER_MAPPED && next->size >= size)) {
+		if (next->state == BUFFER_MAPPED) {
+			next->state = BUFFER_RESIZE;
+			pthread_cond_broadcast(&upload->cond);
+		} else if (next->state == BUFFER_READY) {
+			// Filled but never drawn, a newer one was
+			glDeleteSync(next->fence);
+			next->fence = NULL;
+			next->state = BUFFER_FREE;
+			pthread_cond_broadcast(&upload->cond);
+		}
+		pthread_cond_wait(&upload->cond, &upload->lock);
+	}
+
+	void* mapped = next->mapped;
+	if (mapped != NULL) {
+		next->state = BUFFER_WRITING;
+		next->frame = ++upload->frame;
+		*buffer = upload->next;
+		upload->next = (upload->next + 1) % UPLOAD_THREAD_BUFFERS;
+	} else {
+		next->state = BUFFER_FREE; // Try again next frame
+		pthread_cond_broadcast(&upload->cond);
+	}
+	pthread_mutex_unlock(&upload->lock);
+
+	*wait_ms += millisecondsSince(start);
+	return mapped;
+}
+
+int endUploadBuffer(struct UploadThread* upload, int buffer, size_t written, double* wait_ms) {
+	/* Hands buffer back with written bytes in it. Returns the newest buffer
+	 * of an earlier frame, so buffer unmaps while that one is drawn, or -1 
+	 * if there is none. Follow the draw with fenceUploadBuffer.
+	 */
+	uint64_t start = SDL_GetPerformanceCounter();
+
+	pthread_mutex_lock(&upload->lock);
+	uint64_t frame = upload->buffers[buffer].frame;
+	upload->buffers[buffer].written = written;
+	upload->buffers[buffer].state = BUFFER_FILLED;
+	pthread_cond_broadcast(&upload->cond);
+
+	// Only waits if the frame before is still being unmapped
+	int drawn;
+	for (;;) {
+		bool unmapping = false;
+		drawn = -1;
+		for (int i = 0; i < UPLOAD_THREAD_BUFFERS; ++i) {
+			struct UploadBuffer* candidate = &upload->buffers[i];
+			if (candidate->frame >= frame)
+				continue;
+			if (candidate->state == BUFFER_FILLED)
+				unmapping = true;
+			else if (candidate->state == BUFFER_READY
+					&& (drawn < 0 || candidate->frame > upload->buffers[drawn].frame))
+				drawn = i;
+		}
+		if (!unmapping)
+			break;
+		pthread_cond_wait(&upload->cond, &upload->lock);
+	}
+
+	if (drawn < 0) {
+		pthread_mutex_unlock(&upload->lock);
+		*wait_ms += millisecondsSince(start);
+		return -1;
+	}
+
+	// The older ones are never drawn
+	for (int i = 0; i < UPLOAD_THREAD_BUFFERS; ++i) {
+		struct UploadBuffer* older = &upload->buffers[i];
+		if (i != drawn && older->state == BUFFER_READY && older->frame < upload->buffers[drawn].frame) {
+			glDeleteSync(older->fence);
+			older->fence = NULL;
+			older->state = BUFFER_FREE;
+		}
+	}
+
+	struct UploadBuffer* draw = &upload->buffers[drawn];
+	GLsync fence = draw->fence;
+	draw->fence = NULL;
+	draw->state = draw->written > 0 ? BUFFER_DRAWING : BUFFER_FREE;
+	if (draw->written == 0)
+		drawn = -1;
+	pthread_cond_broadcast(&upload->cond);
+	pthread_mutex_unlock(&upload->lock);
+
+	glWaitSync(fence, 0, GL_TIMEOUT_IGNORED);
+	glDeleteSync(fence);
+
+	*wait_ms += millisecondsSince(start);
+	return drawn;
+}
+
+uint32_t uploadBufferName(struct UploadThread* upload, int buffer) {
+	return upload->buffers[buffer].name;
+}
+
+void fenceUploadBuffer(struct UploadThread* upload, int buffer) {
+	/* Call after the draws that read buffer.
+	 */
+	GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush(); // So the upload thread's wait on it can finish
+
+	pthread_mutex_lock(&upload->lock);
+	upload->buffers[buffer].fence = fence;
+	upload->buffers[buffer].state = BUFFER_DRAWN;
+	pthread_cond_broadcast(&upload->cond);
+	pthread_mutex_unlock(&upload->lock);
+}
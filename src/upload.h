@@ -0,0 +1,26 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+#define UPLOAD_THREAD_BUFFERS 4
+
+/* A thread with a shared GL context that maps and unmaps a ring of buffers
+ * so the render thread never does: beginUploadBuffer, write, endUploadBuffer,
+ * draw once it is done, then fenceUploadBuffer.
+ */
+struct UploadThread;
+
+struct UploadThread* createUploadThread(SDL_Window* window, SDL_GLContext context);
+void destroyUploadThread(struct UploadThread* upload);
+
+void* beginUploadBuffer(struct UploadThread* upload, size_t size, size_t capacity, int* buffer, double* wait_ms);
+int endUploadBuffer(struct UploadThread* upload, int buffer, size_t written, double* wait_ms);
+uint32_t uploadBufferName(struct UploadThread* upload, int buffer);
+void fenceUploadBuffer(struct UploadThread* upload, int buffer);
+
+#endif